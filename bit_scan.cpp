@@ -0,0 +1,139 @@
+#include "bit_scan.h"
+#include <immintrin.h>
+
+namespace bitscan {
+
+bool hasAvx2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+template <ScanOp Op>
+static int forwardScalar(const uint64_t *solid, const uint64_t *crossed,
+                         int from, int to) {
+  for (int k = from; k < to; k++) {
+    if (scanWord<Op>(solid[k], crossed[k]) != 0) {
+      return k;
+    }
+  }
+  return to;
+}
+
+template <ScanOp Op>
+static int backwardScalar(const uint64_t *solid, const uint64_t *crossed,
+                          int from, int to) {
+  for (int k = from; k > to; k--) {
+    if (scanWord<Op>(solid[k], crossed[k]) != 0) {
+      return k;
+    }
+  }
+  return to;
+}
+
+// op applied to four words of each plane.
+template <ScanOp Op>
+__attribute__((target("avx2"))) static inline __m256i scanWords(
+    const uint64_t *solid, const uint64_t *crossed) {
+  __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(solid));
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(crossed));
+  __m256i ones = _mm256_set1_epi64x(-1);
+  switch (Op) {
+    case ScanOp::SOLID:
+      return s;
+    case ScanOp::CROSSED:
+      return c;
+    case ScanOp::FILLED:
+      return _mm256_or_si256(s, c);
+    case ScanOp::NOT_SOLID:
+      return _mm256_xor_si256(s, ones);
+    case ScanOp::NOT_CROSSED:
+      return _mm256_xor_si256(c, ones);
+    case ScanOp::EMPTY:
+      return _mm256_xor_si256(_mm256_or_si256(s, c), ones);
+  }
+  return s;
+}
+
+template <ScanOp Op>
+__attribute__((target("avx2"))) static int forwardAvx2(
+    const uint64_t *solid, const uint64_t *crossed, int from, int to) {
+  int k = from;
+  for (; k + 4 <= to; k += 4) {
+    __m256i v = scanWords<Op>(solid + k, crossed + k);
+    if (!_mm256_testz_si256(v, v)) {
+      break;
+    }
+  }
+  return forwardScalar<Op>(solid, crossed, k, to);
+}
+
+template <ScanOp Op>
+__attribute__((target("avx2"))) static int backwardAvx2(
+    const uint64_t *solid, const uint64_t *crossed, int from, int to) {
+  int k = from;
+  for (; k - 4 >= to; k -= 4) {
+    __m256i v = scanWords<Op>(solid + k - 3, crossed + k - 3);
+    if (!_mm256_testz_si256(v, v)) {
+      break;
+    }
+  }
+  return backwardScalar<Op>(solid, crossed, k, to);
+}
+
+// returns f<op>(...) for an op known only at runtime.
+#define DISPATCH(f, op, ...)                        \
+  switch (op) {                                     \
+    case ScanOp::SOLID:                             \
+      return f<ScanOp::SOLID>(__VA_ARGS__);         \
+    case ScanOp::CROSSED:                           \
+      return f<ScanOp::CROSSED>(__VA_ARGS__);       \
+    case ScanOp::FILLED:                            \
+      return f<ScanOp::FILLED>(__VA_ARGS__);        \
+    case ScanOp::NOT_SOLID:                         \
+      return f<ScanOp::NOT_SOLID>(__VA_ARGS__);     \
+    case ScanOp::NOT_CROSSED:                       \
+      return f<ScanOp::NOT_CROSSED>(__VA_ARGS__);   \
+    case ScanOp::EMPTY:                             \
+      return f<ScanOp::EMPTY>(__VA_ARGS__);         \
+  }                                                 \
+  return to;
+
+int findWordScalar(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+                   int from, int to) {
+  DISPATCH(forwardScalar, op, solid, crossed, from, to)
+}
+
+int findWordAvx2(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+                 int from, int to) {
+  DISPATCH(forwardAvx2, op, solid, crossed, from, to)
+}
+
+int findWordBackwardScalar(ScanOp op, const uint64_t *solid,
+                           const uint64_t *crossed, int from, int to) {
+  DISPATCH(backwardScalar, op, solid, crossed, from, to)
+}
+
+int findWordBackwardAvx2(ScanOp op, const uint64_t *solid,
+                         const uint64_t *crossed, int from, int to) {
+  DISPATCH(backwardAvx2, op, solid, crossed, from, to)
+}
+
+#undef DISPATCH
+
+}  // namespace bitscan
+
+int findWord(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+             int from, int to) {
+  if (bitscan::hasAvx2()) {
+    return bitscan::findWordAvx2(op, solid, crossed, from, to);
+  }
+  return bitscan::findWordScalar(op, solid, crossed, from, to);
+}
+
+int findWordBackward(ScanOp op, const uint64_t *solid,
+                     const uint64_t *crossed, int from, int to) {
+  if (bitscan::hasAvx2()) {
+    return bitscan::findWordBackwardAvx2(op, solid, crossed, from, to);
+  }
+  return bitscan::findWordBackwardScalar(op, solid, crossed, from, to);
+}
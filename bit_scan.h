@@ -0,0 +1,54 @@
+#ifndef _BIT_SCAN_H_
+#define _BIT_SCAN_H_
+
+#include <cstdint>
+
+// Word scans over the solid and crossed bit-planes of a line. Long
+// runs are checked 256 cells at a time with AVX2 when the CPU has it,
+// and one word at a time otherwise.
+
+// What a scan looks for, as a function of the solid and crossed words.
+enum class ScanOp { SOLID, CROSSED, FILLED, NOT_SOLID, NOT_CROSSED, EMPTY };
+
+template <ScanOp Op>
+inline uint64_t scanWord(uint64_t s, uint64_t c) {
+  switch (Op) {
+    case ScanOp::SOLID:
+      return s;
+    case ScanOp::CROSSED:
+      return c;
+    case ScanOp::FILLED:
+      return s | c;
+    case ScanOp::NOT_SOLID:
+      return ~s;
+    case ScanOp::NOT_CROSSED:
+      return ~c;
+    case ScanOp::EMPTY:
+      return ~(s | c);
+  }
+  return 0;
+}
+
+// returns the first word k in [from, to) where op has a set bit, or to
+// if there is none.
+int findWord(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+             int from, int to);
+// returns the last word k in (to, from] where op has a set bit, or to
+// if there is none. to may be -1.
+int findWordBackward(ScanOp op, const uint64_t *solid,
+                     const uint64_t *crossed, int from, int to);
+
+// The implementations behind findWord and findWordBackward, for tests.
+namespace bitscan {
+bool hasAvx2();
+int findWordScalar(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+                   int from, int to);
+int findWordAvx2(ScanOp op, const uint64_t *solid, const uint64_t *crossed,
+                 int from, int to);
+int findWordBackwardScalar(ScanOp op, const uint64_t *solid,
+                           const uint64_t *crossed, int from, int to);
+int findWordBackwardAvx2(ScanOp op, const uint64_t *solid,
+                         const uint64_t *crossed, int from, int to);
+}  // namespace bitscan
+
+#endif  // _BIT_SCAN_H_
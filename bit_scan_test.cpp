@@ -0,0 +1,47 @@
+#include "bit_scan.h"
+#include <iostream>
+#include <random>
+#include <vector>
+
+int main() {
+  std::mt19937_64 rng(1);
+  const ScanOp ops[] = {ScanOp::SOLID,     ScanOp::CROSSED,
+                        ScanOp::FILLED,    ScanOp::NOT_SOLID,
+                        ScanOp::NOT_CROSSED, ScanOp::EMPTY};
+
+  // sparse random planes, so that most scans cross several words.
+  int mismatches = 0;
+  int checks = 0;
+  for (int round = 0; round < 2000; round++) {
+    int words = 1 + rng() % 40;
+    std::vector<uint64_t> solid(words), crossed(words);
+    for (int k = 0; k < words; k++) {
+      solid[k] = rng() % 8 == 0 ? uint64_t(1) << (rng() % 64) : 0;
+      crossed[k] = rng() % 8 == 0 ? uint64_t(1) << (rng() % 64) : 0;
+      if (rng() % 4 == 0) {
+        crossed[k] = ~solid[k];  // a filled word
+      }
+    }
+    int from = rng() % words;
+    int to = from + rng() % (words - from + 1);
+    for (ScanOp op : ops) {
+      int want = bitscan::findWordScalar(op, solid.data(), crossed.data(),
+                                         from, to);
+      int wantBack = bitscan::findWordBackwardScalar(
+          op, solid.data(), crossed.data(), to - 1, from - 1);
+      int got = findWord(op, solid.data(), crossed.data(), from, to);
+      int gotBack =
+          findWordBackward(op, solid.data(), crossed.data(), to - 1, from - 1);
+      if (bitscan::hasAvx2()) {
+        got = bitscan::findWordAvx2(op, solid.data(), crossed.data(), from, to);
+        gotBack = bitscan::findWordBackwardAvx2(op, solid.data(),
+                                                crossed.data(), to - 1, from - 1);
+      }
+      mismatches += (want != got) + (wantBack != gotBack);
+      checks += 2;
+    }
+  }
+  std::cout << "avx2 " << bitscan::hasAvx2() << std::endl;
+  std::cout << mismatches << " mismatches in " << checks << " scans"
+            << std::endl;  // 0 mismatches
+}
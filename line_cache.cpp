@@ -0,0 +1,45 @@
+#include "line_cache.h"
+
+size_t LineCache::KeyHash::operator()(const Key &key) const {
+  uint64_t h = 0xcbf29ce484222325;
+  for (uint64_t w : key) {
+    h ^= w;
+    h *= 0x100000001b3;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+LineCache::LineCache(size_t capacity)
+    : shardCapacity_((capacity + numShards - 1) / numShards) {}
+
+bool LineCache::lookup(const Key &key, Result *result) {
+  size_t h = KeyHash()(key);
+  Shard &shard = shards_[h % numShards];
+  std::lock_guard<std::mutex> g(shard.mutex);
+  auto it = shard.entries.find(key);
+  if (it == shard.entries.end()) {
+    return false;
+  }
+  result->ok = it->second.ok;
+  result->value.assign(it->second.value.begin(), it->second.value.end());
+  return true;
+}
+
+void LineCache::insert(const Key &key, const Result &result) {
+  if (shardCapacity_ == 0) {
+    return;
+  }
+  size_t h = KeyHash()(key);
+  Shard &shard = shards_[h % numShards];
+  std::lock_guard<std::mutex> g(shard.mutex);
+  auto inserted = shard.entries.emplace(key, result);
+  if (!inserted.second) {
+    return;
+  }
+  shard.order.push_back(&inserted.first->first);
+  if (shard.order.size() > shardCapacity_) {
+    shard.entries.erase(shard.entries.find(*shard.order.front()));
+    shard.order.pop_front();
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef _LINE_CACHE_H_
+#define _LINE_CACHE_H_
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// LineCache memoizes line inference. A key packs everything the
+// result depends on (line length, engine, clue, and the solid and
+// crossed bit-planes of the cells); the value is whatever the caller
+// needs to replay the inference, or a contradiction.
+//
+// The cache is safe to share between threads. Entries are spread
+// over shards that each have their own lock, and a full shard evicts
+// its oldest entry, so the total size stays bounded by capacity.
+class LineCache {
+ public:
+  using Key = std::vector<uint64_t>;
+  struct Result {
+    bool ok;  // false for a contradiction
+    std::vector<uint64_t> value;
+  };
+
+  explicit LineCache(size_t capacity);
+
+  // returns true and fills result if key is cached.
+  bool lookup(const Key &key, Result *result);
+  void insert(const Key &key, const Result &result);
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+  struct Shard {
+    std::mutex mutex;  // guards the members below
+    std::unordered_map<Key, Result, KeyHash> entries;
+    std::deque<const Key *> order;  // insertion order, for eviction
+  };
+
+  static constexpr int numShards = 16;
+  size_t shardCapacity_;
+  Shard shards_[numShards];
+};
+
+#endif  // _LINE_CACHE_H_
@@ -0,0 +1,35 @@
+#include "line_cache.h"
+#include <iostream>
+#include <thread>
+
+int main() {
+  LineCache c(64);
+  LineCache::Result r;
+
+  c.insert({1, 2, 3}, LineCache::Result{true, {7, 8}});
+  c.insert({1, 2, 4}, LineCache::Result{false, {}});
+  std::cout << c.lookup({1, 2, 3}, &r) << ' ' << r.ok << ' ' << r.value[1]
+            << std::endl;  // 1 1 8
+  std::cout << c.lookup({1, 2, 4}, &r) << ' ' << r.ok << std::endl;  // 1 0
+  std::cout << c.lookup({1, 2}, &r) << std::endl;                    // 0
+
+  // fill the cache from several threads; the oldest entries go first.
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < 4; t++) {
+    threads.emplace_back([&c, t]() {
+      for (uint64_t i = 0; i < 1000; i++) {
+        c.insert({t, i}, LineCache::Result{true, {i}});
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  int found = 0;
+  for (uint64_t t = 0; t < 4; t++) {
+    for (uint64_t i = 0; i < 1000; i++) {
+      found += c.lookup({t, i}, &r);
+    }
+  }
+  std::cout << (found <= 64) << ' ' << c.lookup({1, 2, 3}, &r) << std::endl;
+}
@@ -1,4 +1,5 @@
 #include "neuronet.hpp"
+#include <cstddef>
 #include <numeric>
 
 Layer::Layer(int dim_in, std::vector<double> &&c)
@@ -18,6 +19,40 @@ std::vector<double> Layer::evaluate(const std::vector<double> &in) const {
   return out;
 };
 
+// Evaluates B inputs at once: each coefficient is loaded once and
+// applied to all of them. Sums are taken in the same order as
+// evaluate(), so the results are identical.
+template <int B>
+static void evaluateBlock(const double *c, int dim_in, int dim_out,
+                          const double *in, double *out) {
+  for (int o = 0; o < dim_out; o++) {
+    const double *w = c + o * (1 + dim_in);
+    double s[B] = {};
+    for (int k = 0; k < dim_in; k++) {
+      for (int b = 0; b < B; b++) {
+        s[b] += in[b * dim_in + k] * w[1 + k];
+      }
+    }
+    for (int b = 0; b < B; b++) {
+      double v = -w[0] + s[b];
+      out[b * dim_out + o] = v > 0 ? v : 0;
+    }
+  }
+}
+
+void Layer::evaluateBatch(const double *in, int n, double *out) const {
+  constexpr int block = 4;
+  int i = 0;
+  for (; i + block <= n; i += block) {
+    evaluateBlock<block>(c_.data(), dim_in_, dim_out_, in + i * dim_in_,
+                         out + i * dim_out_);
+  }
+  for (; i < n; i++) {
+    evaluateBlock<1>(c_.data(), dim_in_, dim_out_, in + i * dim_in_,
+                     out + i * dim_out_);
+  }
+};
+
 Net::Net(std::vector<Layer> &&layers) : layers_(layers){};
 
 Net::Net(const std::vector<std::vector<double>> &coefs, int dim_in) {
@@ -30,9 +65,23 @@ Net::Net(const std::vector<std::vector<double>> &coefs, int dim_in) {
 };
 
 std::vector<double> Net::evaluate(const std::vector<double> &in) const {
-  std::vector<double> out(in);
-  for (auto &l : layers_) {
-    out = l.evaluate(out);
-  }
+  std::vector<double> out, tmp;
+  evaluateBatch(in.data(), 1, &out, &tmp);
   return out;
 };
+
+void Net::evaluateBatch(const double *in, int n, std::vector<double> *out,
+                        std::vector<double> *tmp, int first) const {
+  if (first == static_cast<int>(layers_.size())) {
+    out->assign(in, in + n * layers_.back().dim_out());
+    return;
+  }
+  const double *src = in;
+  for (std::size_t l = first; l < layers_.size(); l++) {
+    // alternate between tmp and out, ending with out.
+    std::vector<double> *dst = (layers_.size() - l) % 2 == 1 ? out : tmp;
+    dst->resize(static_cast<std::size_t>(n) * layers_[l].dim_out());
+    layers_[l].evaluateBatch(src, n, dst->data());
+    src = dst->data();
+  }
+};
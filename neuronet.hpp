@@ -10,7 +10,12 @@ class Layer {
   Layer(int dim_in, std::vector<double> &&c);
   int dim_in() const { return dim_in_; };
   int dim_out() const { return dim_out_; };
+  double threshold(int o) const { return c_[o * (1 + dim_in_)]; };
+  double weight(int o, int i) const { return c_[o * (1 + dim_in_) + 1 + i]; };
   std::vector<double> evaluate(const std::vector<double> &in) const;
+  // Evaluates n inputs of dim_in values each, stored one after another
+  // in in, into n * dim_out values at out.
+  void evaluateBatch(const double *in, int n, double *out) const;
 };
 
 class Net {
@@ -21,5 +26,12 @@ class Net {
   Net(const std::vector<std::vector<double>> &coefs, int dim_in);
   int dim_in() const { return layers_.front().dim_in(); };
   int dim_out() const { return layers_.back().dim_out(); };
+  const Layer &layer(int i) const { return layers_[i]; };
   std::vector<double> evaluate(const std::vector<double> &in) const;
+  // Evaluates n inputs of dim_in values each, stored one after another
+  // in in. out is resized to hold the n * dim_out results; tmp holds
+  // the values between layers. With first > 0, in holds the inputs of
+  // layer first and the layers before it are skipped.
+  void evaluateBatch(const double *in, int n, std::vector<double> *out,
+                     std::vector<double> *tmp, int first = 0) const;
 };
@@ -9,4 +9,21 @@ int main() {
     std::cout << o << ' ';
   }
   std::cout << std::endl;
+
+  // a batch of 5 inputs covers both a full block and the remainder.
+  std::vector<double> in{1, 2, -4, 0, 0, 0, 3, 1, 2, -1, 5, 0, 1, 2, -4};
+  std::vector<double> out, tmp;
+  n.evaluateBatch(in.data(), 5, &out, &tmp);
+  for (int i = 0; i < 5; i++) {
+    std::vector<double> single(in.begin() + 3 * i, in.begin() + 3 * i + 3);
+    std::vector<double> want = l2.evaluate(l1.evaluate(single));
+    bool same = want[0] == out[2 * i] && want[1] == out[2 * i + 1];
+    std::cout << out[2 * i] << ' ' << out[2 * i + 1]
+              << (same ? " ok" : " MISMATCH") << std::endl;
+  }
+
+  // starting at the second layer from the first layer's outputs.
+  std::vector<double> hidden = l1.evaluate(std::vector<double>{3, 1, 2});
+  n.evaluateBatch(hidden.data(), 1, &out, &tmp, 1);
+  std::cout << out[0] << ' ' << out[1] << std::endl;
 }
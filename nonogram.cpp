@@ -1,5 +1,7 @@
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <vector>
 #include "cxxopts.hpp"
 #include "json.hpp"
@@ -40,23 +42,162 @@ PictureFile readPictureFile(std::string filename) {
   return p;
 };
 
-// global config object
-static Solver::Config config;
+// global config objects. With more than one, every puzzle is solved
+// with all of them at once and the first solution wins.
+static std::vector<std::unique_ptr<Solver::Config>> configs;
+
+// threads that may run at once: the TaskQueue workers busy with a file
+// and the helpers that parallel search starts on top of them.
+static ThreadBudget budget(std::thread::hardware_concurrency());
 
 std::string RunSolver(std::string filename) {
   auto p = readPictureFile(filename);
+  if (!Solver::validPuzzle(p.rows, p.cols)) {
+    std::ostringstream stringStream;
+    stringStream << filename << " invalid " << p.cols.size() << " "
+                 << p.rows.size();
+    return stringStream.str();
+  }
 
-  Solver s(config, std::move(p.rows), std::move(p.cols));
-  bool solved = s.solve();
+  // solvers of the TaskQueue worker, one per config, reset for each
+  // file so that their memory is reused. The racing threads below see
+  // them through this reference, not through their own thread_local.
+  thread_local std::vector<std::unique_ptr<Solver>> pool;
+  auto &solvers = pool;
+  std::atomic<bool> cancel{false};
+  for (size_t i = 0; i < configs.size(); i++) {
+    if (i < solvers.size()) {
+      solvers[i]->reset(p.rows, p.cols);
+    } else {
+      auto rows = p.rows;
+      auto cols = p.cols;
+      solvers.push_back(std::make_unique<Solver>(*configs[i], std::move(rows),
+                                                 std::move(cols)));
+    }
+    solvers[i]->cancel_ = &cancel;
+  }
+
+  // run config i; the first one to solve the puzzle cancels the rest.
+  std::atomic<int> winner{-1};
+  auto run = [&](int i) {
+    if (solvers[i]->solve()) {
+      int none = -1;
+      if (winner.compare_exchange_strong(none, i)) {
+        cancel = true;
+      }
+    }
+  };
+  // a config races on a thread of its own only when the budget has one
+  // to spare; the others run in order on this worker.
+  budget.Acquire();
+  std::vector<std::thread> racers;
+  std::vector<int> inOrder = {0};
+  for (int i = 1; i < int(solvers.size()); i++) {
+    if (budget.TryAcquire()) {
+      racers.emplace_back([&run, i] {
+        run(i);
+        budget.Release();
+      });
+    } else {
+      inOrder.push_back(i);
+    }
+  }
+  for (int i : inOrder) {
+    if (winner >= 0) {
+      break;
+    }
+    run(i);
+  }
+  budget.Release();
+  for (auto &t : racers) {
+    t.join();
+  }
+
+  // without a winner, report a config that ran out of time or memory
+  // if any.
+  bool solved = winner >= 0;
+  int i = solved ? winner.load() : 0;
+  for (int j = 0; !solved && j < int(solvers.size()); j++) {
+    if (solvers[j]->timedOut_ || solvers[j]->outOfMemory_) {
+      i = j;
+      break;
+    }
+  }
+  const Solver &s = *solvers[i];
+  const Solver::Config &config = *configs[i];
   std::ostringstream stringStream;
 
-  stringStream << filename << (solved ? " solved " : " failed ") << s.width_
+  const char *status = solved           ? " solved "
+                       : s.timedOut_    ? " timeout "
+                       : s.outOfMemory_ ? " memory "
+                                        : " failed ";
+  stringStream << filename << status << s.width_
                << " " << s.height_ << " " << s.stats_.lineCount << " "
                << s.stats_.wrongGuesses << " " << s.stats_.maxDepth;
+  if (config.cache) {
+    stringStream << " " << s.stats_.cacheHits << "/" << s.stats_.cacheLookups;
+  }
+  if (config.probeCandidates > 0) {
+    stringStream << " " << s.stats_.probeFixed << "/" << s.stats_.probes;
+  }
+  if (config.recomputeEvery > 0 || config.maxStateBytes > 0) {
+    stringStream << " " << s.stats_.peakStateBytes << "B";
+  }
+  if (configs.size() > 1) {
+    stringStream << " config " << i;
+  }
 
   return stringStream.str();
 }
 
+// fills config from its json representation. Returns false on error.
+bool parseConfig(const nlohmann::json &config_json, Solver::Config *config) {
+  config->wiggleRoom = config_json["wiggleRoom"];
+  config->numSegments = config_json["numSegments"];
+  config->doneSegments = config_json["doneSegments"];
+  config->numChanges = config_json["numChanges"];
+  config->rowCoef = config_json["rowCoef"];
+  config->colCoef = config_json["colCoef"];
+  std::vector<double> edgeScore = config_json["edgeScore"];
+  if (edgeScore.size() != edgeScoreLen) {
+    return false;
+  }
+  std::copy(edgeScore.begin(), edgeScore.end(), config->edgeScore);
+
+  std::vector<std::vector<double>> coef = config_json["coef"];
+  Net *net = new Net(coef, gridSize);
+  if (net->dim_out() != 2) {
+    std::cerr << "config: coef dimensionality error\n";
+    return false;
+  }
+  config->n = std::unique_ptr<Net>(net);
+  config->maxLines = config_json["maxLines"];
+  config->timeoutMs = config_json.value("timeoutMs", 0);
+  std::string lineSolver = config_json.value("lineSolver", "heuristic");
+  if (lineSolver == "heuristic") {
+    config->lineSolver = LineSolver::HEURISTIC;
+  } else if (lineSolver == "exact") {
+    config->lineSolver = LineSolver::EXACT;
+  } else if (lineSolver == "hybrid") {
+    config->lineSolver = LineSolver::HYBRID;
+  } else {
+    std::cerr << "config: unknown lineSolver " << lineSolver << "\n";
+    return false;
+  }
+  config->probeCandidates = config_json.value("probeCandidates", 0);
+  config->threads = config_json.value("threads", 1);
+  config->recomputeEvery = config_json.value("recomputeEvery", 0);
+  config->maxStateBytes = config_json.value("maxStateBytes", 0L);
+  config->incrementalFit = config_json.value("incrementalFit", true);
+  config->wordFit = config_json.value("wordFit", true);
+  config->budget = &budget;
+  int lineCache = config_json.value("lineCache", 0);
+  if (lineCache > 0) {
+    config->cache = std::make_unique<LineCache>(lineCache);
+  }
+  return true;
+}
+
 int main(int argc, char *argv[]) {
   cxxopts::Options options("nonogram", "nonogram solver");
   options.add_options()("config", "config json string",
@@ -73,27 +214,17 @@ int main(int argc, char *argv[]) {
 
   auto &files = opt["f"].as<std::vector<std::string>>();
 
+  // config is a json object, or an array of them for a portfolio.
   auto config_json = nlohmann::json::parse(opt["config"].as<std::string>());
-  config.wiggleRoom = config_json["wiggleRoom"];
-  config.numSegments = config_json["numSegments"];
-  config.doneSegments = config_json["doneSegments"];
-  config.numChanges = config_json["numChanges"];
-  config.rowCoef = config_json["rowCoef"];
-  config.colCoef = config_json["colCoef"];
-  std::vector<double> edgeScore = config_json["edgeScore"];
-  if (edgeScore.size() != edgeScoreLen) {
-    return (1);
+  if (!config_json.is_array()) {
+    config_json = nlohmann::json::array({config_json});
   }
-  std::copy(edgeScore.begin(), edgeScore.end(), config.edgeScore);
-
-  std::vector<std::vector<double>> coef = config_json["coef"];
-  Net *net = new Net(coef, gridSize);
-  if (net->dim_out() != 2) {
-    std::cerr << "config: coef dimensionality error\n";
-    return 1;
+  for (auto &c : config_json) {
+    configs.push_back(std::make_unique<Solver::Config>());
+    if (!parseConfig(c, configs.back().get())) {
+      return 1;
+    }
   }
-  config.n = std::unique_ptr<Net>(net);
-  config.maxLines = config_json["maxLines"];
 
   TaskQueue q(20);
   for (auto f : files) {
@@ -1,118 +1,419 @@
 #include "nonogram_solver.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
+
+// BitGrid implementation
+
+BitGrid::BitGrid(int width, int height) { reset(width, height); }
+
+void BitGrid::reset(int width, int height) {
+  width_ = width;
+  height_ = height;
+  rowWords_ = (width + 2 * gridHalfEdge + wordBits - 1) / wordBits;
+  colWords_ = (height + 2 * gridHalfEdge + wordBits - 1) / wordBits;
+  rows_.assign(2 * (height + 2 * gridHalfEdge) * rowWords_, 0);
+  cols_.assign(2 * (width + 2 * gridHalfEdge) * colWords_, 0);
+  rowSummaryWords_ = summaryWords(rowWords_);
+  colSummaryWords_ = summaryWords(colWords_);
+  rowSummary_.assign(3 * (height + 2 * gridHalfEdge) * rowSummaryWords_, 0);
+  colSummary_.assign(3 * (width + 2 * gridHalfEdge) * colSummaryWords_, 0);
+  for (int y = -gridHalfEdge; y < height + gridHalfEdge; y++) {
+    for (int x = -gridHalfEdge; x < width + gridHalfEdge; x++) {
+      if (x < 0 || x >= width || y < 0 || y >= height) {
+        set(x, y, CellState::CROSSED);
+      }
+    }
+  }
+  // the words without border cells hold EMPTY cells.
+  for (int y = 0; y < height && rowSummaryWords_ > 0; y++) {
+    for (int k = 0; k < rowWords_; k++) {
+      summarize(&rowSummary_[3 * (y + gridHalfEdge) * rowSummaryWords_],
+                rowSummaryWords_, &rows_[rowWord(-gridHalfEdge, y)],
+                rowWords_, k);
+    }
+  }
+  for (int x = 0; x < width && colSummaryWords_ > 0; x++) {
+    for (int k = 0; k < colWords_; k++) {
+      summarize(&colSummary_[3 * (x + gridHalfEdge) * colSummaryWords_],
+                colSummaryWords_, &cols_[colWord(x, -gridHalfEdge)],
+                colWords_, k);
+    }
+  }
+}
+
+void BitGrid::summarize(uint64_t *summary, int summaryWords,
+                        const uint64_t *w, int words, int k) {
+  uint64_t s = w[k];
+  uint64_t c = w[words + k];
+  uint64_t bit = uint64_t(1) << (k % wordBits);
+  uint64_t *j = summary + k / wordBits;
+  j[0] = s != 0 ? j[0] | bit : j[0] & ~bit;
+  j[summaryWords] = c != 0 ? j[summaryWords] | bit : j[summaryWords] & ~bit;
+  j[2 * summaryWords] = ~(s | c) != 0 ? j[2 * summaryWords] | bit
+                                      : j[2 * summaryWords] & ~bit;
+}
+
+void BitGrid::set(int x, int y, CellState s) {
+  int plane = s == CellState::SOLID ? 0 : 1;
+  size_t r = rowWord(x, y);
+  size_t c = colWord(x, y);
+  rows_[r + plane * rowWords_] |= bit(x);
+  cols_[c + plane * colWords_] |= bit(y);
+  if (rowSummaryWords_ > 0 && y >= 0 && y < height_) {
+    summarize(&rowSummary_[3 * (y + gridHalfEdge) * rowSummaryWords_],
+              rowSummaryWords_, &rows_[rowWord(-gridHalfEdge, y)], rowWords_,
+              (x + gridHalfEdge) / wordBits);
+  }
+  if (colSummaryWords_ > 0 && x >= 0 && x < width_) {
+    summarize(&colSummary_[3 * (x + gridHalfEdge) * colSummaryWords_],
+              colSummaryWords_, &cols_[colWord(x, -gridHalfEdge)], colWords_,
+              (y + gridHalfEdge) / wordBits);
+  }
+}
+
+void BitGrid::clear(int x, int y) {
+  size_t r = rowWord(x, y);
+  size_t c = colWord(x, y);
+  rows_[r] &= ~bit(x);
+  rows_[r + rowWords_] &= ~bit(x);
+  cols_[c] &= ~bit(y);
+  cols_[c + colWords_] &= ~bit(y);
+  if (rowSummaryWords_ > 0) {
+    summarize(&rowSummary_[3 * (y + gridHalfEdge) * rowSummaryWords_],
+              rowSummaryWords_, &rows_[rowWord(-gridHalfEdge, y)], rowWords_,
+              (x + gridHalfEdge) / wordBits);
+  }
+  if (colSummaryWords_ > 0) {
+    summarize(&colSummary_[3 * (x + gridHalfEdge) * colSummaryWords_],
+              colSummaryWords_, &cols_[colWord(x, -gridHalfEdge)], colWords_,
+              (y + gridHalfEdge) / wordBits);
+  }
+}
+
+void BitGrid::assign(const BitGrid &o) {
+  width_ = o.width_;
+  height_ = o.height_;
+  rowWords_ = o.rowWords_;
+  colWords_ = o.colWords_;
+  rows_.assign(o.rows_.begin(), o.rows_.end());
+  cols_.assign(o.cols_.begin(), o.cols_.end());
+  rowSummaryWords_ = o.rowSummaryWords_;
+  colSummaryWords_ = o.colSummaryWords_;
+  rowSummary_.assign(o.rowSummary_.begin(), o.rowSummary_.end());
+  colSummary_.assign(o.colSummary_.begin(), o.colSummary_.end());
+}
+
+const uint64_t *BitGrid::solid(LineName name) const {
+  if (name.dir == Direction::ROW) {
+    return &rows_[2 * (name.index + gridHalfEdge) * rowWords_];
+  }
+  return &cols_[2 * (name.index + gridHalfEdge) * colWords_];
+}
+
+const uint64_t *BitGrid::crossed(LineName name) const {
+  if (name.dir == Direction::ROW) {
+    return solid(name) + rowWords_;
+  }
+  return solid(name) + colWords_;
+}
+
+const uint64_t *BitGrid::summary(LineName name) const {
+  if (name.dir == Direction::ROW) {
+    if (rowSummaryWords_ == 0) return nullptr;
+    return &rowSummary_[3 * (name.index + gridHalfEdge) * rowSummaryWords_];
+  }
+  if (colSummaryWords_ == 0) return nullptr;
+  return &colSummary_[3 * (name.index + gridHalfEdge) * colSummaryWords_];
+}
 
 // Slice implementation
 
-Slice::Slice(Solver &solver, int offset0, int step, int length)
+template <bool Reversed>
+BasicSlice<Reversed>::BasicSlice(Solver &solver, LineName name)
     : solver_(solver),
-      g_(solver.g_),
-      offset0_(offset0),
-      step_(step),
-      length_(length){};
+      name_(name),
+      solid_(solver.g_.solid(name)),
+      crossed_(solver.g_.crossed(name)),
+      summary_(solver.g_.summary(name)),
+      length_(name.dir == Direction::ROW ? solver.width_ : solver.height_) {}
 
-Slice::Slice(Solver &solver, LineName name) : solver_(solver), g_(solver.g_) {
-  if (name.dir == Direction::ROW) {
-    offset0_ = solver.width_ * name.index;
-    step_ = 1;
-    length_ = solver.width_;
+template <bool Reversed>
+void BasicSlice<Reversed>::set(int i, CellState s) const {
+  int c = Reversed ? length_ - 1 - i : i;
+  if (name_.dir == Direction::ROW) {
+    solver_.set(c, name_.index, s);
   } else {
-    offset0_ = name.index;
-    step_ = solver.width_;
-    length_ = solver.height_;
+    solver_.set(name_.index, c, s);
   }
 }
 
-void Slice::set(int i, CellState s) const {
-  int o = offset0_ + step_ * i;
-  int x = o % solver_.width_;
-  int y = (o - x) / solver_.width_;
-  solver_.set(x, y, s);
+template <bool Reversed>
+template <ScanOp Op>
+uint64_t BasicSlice<Reversed>::summaryWord(int j) const {
+  const uint64_t *solid = summary_ + j;
+  const uint64_t *crossed = solid + (words() + wordBits - 1) / wordBits;
+  const uint64_t *empty = crossed + (words() + wordBits - 1) / wordBits;
+  switch (Op) {
+    case ScanOp::SOLID:
+      return *solid;
+    case ScanOp::CROSSED:
+      return *crossed;
+    case ScanOp::FILLED:
+      return *solid | *crossed;
+    case ScanOp::NOT_SOLID:
+      return *crossed | *empty;
+    case ScanOp::NOT_CROSSED:
+      return *solid | *empty;
+    case ScanOp::EMPTY:
+      return *empty;
+  }
+  return 0;
 }
 
-int Slice::findHoleStartingAt(int start, int length) const {
-  int found = 0;
-  for (int i = start; i < length_; i++) {
-    if (get(i) == CellState::CROSSED) {
-      found = 0;
-    } else {
-      found += 1;
-      if (found >= length) {
-        return i - found + 1;
+// words a scan needs left to hand over to findWord, one AVX2 vector.
+constexpr int vectorScanWords = 4;
+
+// Long lines have a summary, see BitGrid, and the rest of the scans go
+// through findWord once they have a vector of words left.
+template <bool Reversed>
+template <ScanOp Op>
+int BasicSlice<Reversed>::nextWord(int from, int to) const {
+  if (summary_ != nullptr && to - from >= longLineWords) {
+    int j = from / wordBits;
+    uint64_t w = summaryWord<Op>(j) & (~uint64_t(0) << (from % wordBits));
+    while (w == 0) {
+      if (++j * wordBits >= to) {
+        return to;
       }
+      w = summaryWord<Op>(j);
     }
+    return std::min(j * wordBits + __builtin_ctzll(w), to);
   }
-  return -1;
-};
+  if (to - from >= vectorScanWords) {
+    return findWord(Op, solid_, crossed_, from, to);
+  }
+  while (from < to && scanWord<Op>(solid_[from], crossed_[from]) == 0) {
+    from++;
+  }
+  return from;
+}
 
-int Slice::stripLength(int i) const {
-  CellState val = get(i);
-  int n = 0;
-  for (; i < length_; i++) {
-    if (get(i) == val) {
-      n++;
-    } else {
-      return n;
+template <bool Reversed>
+template <ScanOp Op>
+int BasicSlice<Reversed>::prevWord(int from, int to) const {
+  if (summary_ != nullptr && from - to >= longLineWords) {
+    int j = from / wordBits;
+    uint64_t w =
+        summaryWord<Op>(j) & (~uint64_t(0) >> (wordBits - 1 - from % wordBits));
+    while (w == 0) {
+      if (--j < 0 || j * wordBits + wordBits - 1 <= to) {
+        return to;
+      }
+      w = summaryWord<Op>(j);
+    }
+    return std::max(j * wordBits + wordBits - 1 - __builtin_clzll(w), to);
+  }
+  if (from - to >= vectorScanWords) {
+    return findWordBackward(Op, solid_, crossed_, from, to);
+  }
+  while (from > to && scanWord<Op>(solid_[from], crossed_[from]) == 0) {
+    from--;
+  }
+  return from;
+}
+
+template <bool Reversed>
+template <ScanOp Op>
+int BasicSlice<Reversed>::scan(int start, int end) const {
+  if (start >= end) {
+    return end;
+  }
+  int p = pos(start);
+  int k = p / wordBits;
+  int last = pos(end - 1) / wordBits;  // the word of the last cell
+  if constexpr (!Reversed) {
+    uint64_t w = scanWord<Op>(solid_[k], crossed_[k]) &
+                 (~uint64_t(0) << (p % wordBits));
+    if (w == 0) {
+      k = nextWord<Op>(k + 1, last + 1);
+      if (k > last) {
+        return end;
+      }
+      w = scanWord<Op>(solid_[k], crossed_[k]);
+    }
+    int i = index(k * wordBits + __builtin_ctzll(w));
+    return i < end ? i : end;
+  }
+
+  // walk the underlying line backwards from pos(start).
+  uint64_t w = scanWord<Op>(solid_[k], crossed_[k]) &
+               (~uint64_t(0) >> (wordBits - 1 - p % wordBits));
+  if (w == 0) {
+    k = prevWord<Op>(k - 1, last - 1);
+    if (k < last) {
+      return end;
+    }
+    w = scanWord<Op>(solid_[k], crossed_[k]);
+  }
+  int i = index(k * wordBits + wordBits - 1 - __builtin_clzll(w));
+  return i < end ? i : end;
+}
+
+template <bool Reversed>
+template <ScanOp Op>
+int BasicSlice<Reversed>::scanToBorder(int start) const {
+  int p = pos(start);
+  int k = p / wordBits;
+  if constexpr (!Reversed) {
+    uint64_t w = scanWord<Op>(solid_[k], crossed_[k]) &
+                 (~uint64_t(0) << (p % wordBits));
+    if (w == 0) {
+      k = nextWord<Op>(k + 1, words());
+      w = scanWord<Op>(solid_[k], crossed_[k]);
     }
+    return index(k * wordBits + __builtin_ctzll(w));
   }
-  return n;
+  uint64_t w = scanWord<Op>(solid_[k], crossed_[k]) &
+               (~uint64_t(0) >> (wordBits - 1 - p % wordBits));
+  if (w == 0) {
+    k = prevWord<Op>(k - 1, -1);
+    w = scanWord<Op>(solid_[k], crossed_[k]);
+  }
+  return index(k * wordBits + wordBits - 1 - __builtin_clzll(w));
 }
 
-int Slice::indexOfNextSolid(int start, int bound) const {
-  for (int i = start; i < bound; i++) {
-    if (get(i) == CellState::SOLID) {
-      return i;
+template <bool Reversed>
+int BasicSlice<Reversed>::findHoleStartingAt(int start, int length) const {
+  while (start < length_) {
+    int cross = scanToBorder<ScanOp::CROSSED>(start);
+    if (cross - start >= length) {
+      return start;
     }
+    start = cross + 1;
   }
   return -1;
+};
+
+template <bool Reversed>
+int BasicSlice<Reversed>::stripLength(int i) const {
+  switch (get(i)) {
+    case CellState::EMPTY:
+      return scanToBorder<ScanOp::FILLED>(i) - i;
+    case CellState::SOLID:
+      return scanToBorder<ScanOp::NOT_SOLID>(i) - i;
+    case CellState::CROSSED:
+      return scan<ScanOp::NOT_CROSSED>(i, length_) - i;
+  }
+  return 0;
+}
+
+template <bool Reversed>
+int BasicSlice<Reversed>::indexOfNextSolid(int start, int bound) const {
+  if (bound > length_) {
+    bound = length_;
+  }
+  int i = scan<ScanOp::SOLID>(start, bound);
+  return i < bound ? i : -1;
+}
+
+template <bool Reversed>
+int BasicSlice<Reversed>::indexOfNextEmpty(int start) const {
+  int i = scan<ScanOp::EMPTY>(start, length_);
+  return i < length_ ? i : -1;
 }
 
 // setSegment between i and j (exclusive) to state val. Return number
 // of cells changed.
-int Slice::setSegment(int i, int j, CellState val) const {
+template <bool Reversed>
+int BasicSlice<Reversed>::setSegment(int i, int j, CellState val) const {
+  if (i < 0) {
+    i = 0;
+  }
+  if (j > length_) {
+    j = length_;
+  }
   int changed = 0;
-  for (int n = i; n < j; n++) {
-    if (get(n) != val) {
-      set(n, val);
-      changed++;
-    }
+  // the next cell at or after n that is not val yet.
+  auto differs = [this, val, j](int n) {
+    return val == CellState::SOLID ? scan<ScanOp::NOT_SOLID>(n, j)
+                                   : scan<ScanOp::NOT_CROSSED>(n, j);
+  };
+  for (int n = differs(i); n < j; n = differs(n + 1)) {
+    set(n, val);
+    changed++;
   }
   return changed;
 }
 
-Slice Slice::reverse() const {
-  return Slice(solver_, offset0_ + step_ * (length_ - 1), -step_, length_);
+template <bool Reversed>
+BasicSlice<!Reversed> BasicSlice<Reversed>::reverse() const {
+  return BasicSlice<!Reversed>(solver_, name_);
 }
 
+template class BasicSlice<false>;
+template class BasicSlice<true>;
+
 // Line implementation
-Line::Line(Solver &solver, LineName name, std::vector<int> &&len)
-    : len_(len),
-      lb_(len.size()),
-      ub_(len.size()),
-      done_(len.size()),
+
+// levels of the sparse tables of n clues, 1 + log2(n).
+static int tableLevels(int n) { return n > 0 ? 32 - __builtin_clz(n) : 0; }
+
+Line::Line(Solver &solver, LineName name)
+    : solver_(solver),
       slice_(solver, name),
       name(name) {
+  int i = solver.lineIndex(name);
+  int first = solver.arena_.first[i];
+  n_ = solver.arena_.first[i + 1] - first;
+  len_ = solver.arena_.clues.data() + 2 * first;
+  minLen_ = solver.arena_.lenTables.data() + solver.arena_.tableFirst[i];
+  maxLen_ = minLen_ + tableLevels(n_) * n_;
+  lb_ = &solver.arena_.bounds[3 * first + 2 * i];
+  ub_ = lb_ + n_;
+  done_ = ub_ + n_;
+  changed_ = done_ + n_;
+  changed_[0] = 0;
+  changed_[1] = slice_.length() + 2;
+  int words = (slice_.length() + wordBits - 1) / wordBits;
+  words_ = !solver.config_.wordFit ? 0
+           : words <= 2            ? std::max(words, 1)
+           : words <= maxFitWords  ? maxFitWords
+                                   : 0;
+
   int sum = 0;
-  for (auto l : len) {
-    sum += l;
+  for (int k = 0; k < n_; k++) {
+    sum += len_[k];
   }
   stats.wiggleRoom = slice_.length() - sum;
-  stats.numSegments = len.size();
+  stats.numSegments = n_;
   stats.doneSegments = 0;
   stats.numChanges = 0;
 }
 
+Line::Line(Solver &solver, const Line &other) : Line(solver, other.name) {
+  changed_[0] = other.changed_[0];
+  changed_[1] = other.changed_[1];
+  stats = other.stats;
+}
+
 void Line::updateStats() {
   int w = 0;
 
-  for (int i = 0; i < lb_.size(); i++) {
+  for (int i = 0; i < n_; i++) {
     int wi = ub(i) - lb(i) + 1 - len_[i];
     if (w < wi) w = wi;
   }
   stats.wiggleRoom = w;
 
   int total_done = 0;
-  for (auto d : done_) {
-    if (d) {
+  for (int i = 0; i < n_; i++) {
+    if (done_[i]) {
       total_done++;
     }
   }
@@ -123,13 +424,36 @@ void Line::updateStats() {
 // Fit all segments to the leftmost position in slice, satisfying the
 // constraints. Also obey known lower bound. Returns false when no fit
 // can be found.
-bool Line::fitLeftMost(Slice slice, const std::vector<int> &len,
-                       std::vector<int> &lb) {
-  int cursor = 0;  // cursor tracks a position in slice
-  int i = 0;       // i is an index of sLen / lb
+//
+// lb is the leftmost fit from before cells [from, to) changed, and
+// only moves right. Segments that end, with the cell after them,
+// before from keep their place, so the fit starts after them; it may
+// still pull them to cover a solid strip. Once a segment past the
+// changed cells lands where it was, the segments after it stay put
+// too.
+template <typename S>
+bool Line::fitLeftMost(const S &slice, const uint16_t *len, int n, int *lb,
+                       int from, int to) {
+  if (from >= to) {
+    return true;
+  }
+  // the segments that reach from, with the cell after them, are the
+  // first ones woken; lb[i] + len[i] grows with i.
+  int i = 0;  // i is an index of sLen / lb
+  int hi = n;
+  while (i < hi) {
+    int mid = (i + hi) / 2;
+    if (lb[mid] + len[mid] < from) {
+      i = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  int cursor = i > 0 ? lb[i - 1] + len[i - 1] + 1 : 0;
+  int next = i;  // segments from next on hold their old place
 
   while (cursor < slice.length()) {
-    int lBound = i >= len.size() ? slice.length() : lb[i];
+    int lBound = i >= n ? slice.length() : lb[i];
     if (lBound > cursor) {
       int nextSolid = slice.indexOfNextSolid(cursor, lBound);
       if (nextSolid == -1) {
@@ -159,33 +483,313 @@ bool Line::fitLeftMost(Slice slice, const std::vector<int> &len,
     if (hole == -1) {
       return false;
     }
+    // a solid in a smaller hole before it is left to an earlier
+    // segment; hole becomes the lower bound of this one.
+    if (hole > cursor && slice.indexOfNextSolid(cursor, hole) != -1) {
+      lb[i] = hole;
+      next = std::max(next, i + 1);
+      continue;
+    }
 
     // Move the segment forward if the tail is next to a solid
     // cell. Also remember if skipped over solids - need to
     // trace back and find an earlier segment to cover it in
     // that case.
     bool skippedSolid = false;
-    while (hole + len[i] < slice.length() &&
-           slice.get(hole + len[i]) == CellState::SOLID) {
+    while (slice.get(hole + len[i]) == CellState::SOLID) {
       skippedSolid = skippedSolid || slice.get(hole) == CellState::SOLID;
       hole++;
     }
+    bool moved = i < next || hole != lb[i];
     lb[i] = hole;
+    next = std::max(next, i + 1);
     if (!skippedSolid) {
       // set next allowable position and work on next segment
       cursor = hole + len[i] + 1;
       i++;
+      if (!moved && cursor >= to) {
+        return true;
+      }
     }
   }  // cursor loop
   // check remaining segment constraints
-  if (i < len.size()) {
+  if (i < n) {
     return false;
   }
   return true;
 }
 
-bool Line::inferSegments() {
-  for (int i = 0; i < numSegments(); i++) {
+// Cells [0, 64 * W) of a line as bits, for fitWords.
+template <size_t W>
+using LineBits = std::array<uint64_t, W>;
+
+namespace {
+
+// the cells of a plane of a slice, which starts with the border.
+template <size_t W>
+LineBits<W> loadCells(const uint64_t *plane, int words) {
+  LineBits<W> r;
+  for (int i = 0; i < int(W); i++) {
+    uint64_t lo = i < words ? plane[i] >> gridHalfEdge : 0;
+    uint64_t hi =
+        i + 1 < words ? plane[i + 1] << (wordBits - gridHalfEdge) : 0;
+    r[i] = lo | hi;
+  }
+  return r;
+}
+
+// bits [from, to) set.
+template <size_t W>
+void setRange(LineBits<W> &x, int from, int to) {
+  for (int i = from / wordBits; i < int(W) && i * wordBits < to; i++) {
+    uint64_t m = ~uint64_t(0);
+    if (i == from / wordBits) {
+      m <<= from % wordBits;
+    }
+    if ((i + 1) * wordBits > to) {
+      m &= ~(~uint64_t(0) << (to % wordBits));
+    }
+    x[i] |= m;
+  }
+}
+
+// bit i of the result is bit i - s of x.
+template <size_t W>
+LineBits<W> shiftUp(const LineBits<W> &x, int s) {
+  LineBits<W> r{};
+  int q = s / wordBits, b = s % wordBits;
+  for (int i = int(W) - 1; i >= q; i--) {
+    r[i] = x[i - q] << b;
+    if (b > 0 && i > q) {
+      r[i] |= x[i - q - 1] >> (wordBits - b);
+    }
+  }
+  return r;
+}
+
+// bit i of the result is bit i + s of x.
+template <size_t W>
+LineBits<W> shiftDown(const LineBits<W> &x, int s) {
+  LineBits<W> r{};
+  int q = s / wordBits, b = s % wordBits;
+  for (int i = 0; i + q < int(W); i++) {
+    r[i] = x[i + q] >> b;
+    if (b > 0 && i + q + 1 < int(W)) {
+      r[i] |= x[i + q + 1] << (wordBits - b);
+    }
+  }
+  return r;
+}
+
+uint64_t reverseBits(uint64_t x) {
+  x = __builtin_bswap64(x);
+  x = (x >> 4 & 0x0F0F0F0F0F0F0F0F) | (x & 0x0F0F0F0F0F0F0F0F) << 4;
+  x = (x >> 2 & 0x3333333333333333) | (x & 0x3333333333333333) << 2;
+  return (x >> 1 & 0x5555555555555555) | (x & 0x5555555555555555) << 1;
+}
+
+// bit i of the result is bit 64 * W - 1 - i of x.
+template <size_t W>
+LineBits<W> reverseCells(const LineBits<W> &x) {
+  LineBits<W> r;
+  for (int i = 0; i < int(W); i++) {
+    r[i] = reverseBits(x[W - 1 - i]);
+  }
+  return r;
+}
+
+// the bits of x, and those that a run of open bits reaches from one of
+// them: bit i is set when bit j <= i of x is, and bits [j, i) of open.
+// Adding open to the bits of x that are open carries each of them
+// through the run of open bits it is in, clearing the run from there
+// on and setting the bit after it.
+template <size_t W>
+LineBits<W> fillRuns(const LineBits<W> &x, const LineBits<W> &open) {
+  LineBits<W> r;
+  uint64_t carry = 0;
+  for (int i = 0; i < int(W); i++) {
+    uint64_t a = x[i] & open[i];
+    uint64_t sum = a + open[i];
+    uint64_t c = sum < a;
+    sum += carry;
+    carry = c | (sum < carry);
+    r[i] = x[i] | (sum ^ open[i]);
+  }
+  return r;
+}
+
+// the starts of a segment of length len: bits [i, i + len) of
+// notCrossed are set and bit i + len of solid is not.
+template <size_t W>
+LineBits<W> starts(const LineBits<W> &notCrossed, const LineBits<W> &solid,
+                   int len) {
+  LineBits<W> r = notCrossed;
+  for (int run = 1; run < len;) {
+    int s = std::min(run, len - run);
+    LineBits<W> next = shiftDown(r, s);
+    for (int i = 0; i < int(W); i++) {
+      r[i] &= next[i];
+    }
+    run += s;
+  }
+  LineBits<W> after = shiftDown(solid, len);
+  for (int i = 0; i < int(W); i++) {
+    r[i] &= ~after[i];
+  }
+  return r;
+}
+
+template <size_t W>
+bool anyBit(const LineBits<W> &x) {
+  for (int i = 0; i < int(W); i++) {
+    if (x[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <size_t W>
+int lowestBit(const LineBits<W> &x) {
+  for (int i = 0; i < int(W); i++) {
+    if (x[i] != 0) {
+      return i * wordBits + __builtin_ctzll(x[i]);
+    }
+  }
+  return -1;
+}
+
+template <size_t W>
+int highestBit(const LineBits<W> &x) {
+  for (int i = int(W) - 1; i >= 0; i--) {
+    if (x[i] != 0) {
+      return i * wordBits + wordBits - 1 - __builtin_clzll(x[i]);
+    }
+  }
+  return -1;
+}
+
+}  // namespace
+
+// Bit i stands for cell i, and for a segment starting there. F(k), the
+// starts of segment k that leave room for segments [0, k) before them,
+// is F(0) = fillRuns({0}) and F(k + 1) = fillRuns(P(k) << (len(k) + 1)), where
+// P(k) = F(k) & starts(len(k)) and fill runs over the cells that are
+// not solid. The same on the reversed line gives the starts of each
+// segment that leave room for the segments after it, and a start in
+// both sets is one of a fit of the whole line.
+template <int W>
+bool Line::fitWords(int *left, int *right) {
+  int n = slice_.length();
+  int words = slice_.words();
+  LineBits<W> cells{};
+  setRange(cells, 0, n);
+  LineBits<W> solid = loadCells<W>(slice_.solidWords(), words);
+  LineBits<W> crossed = loadCells<W>(slice_.crossedWords(), words);
+  LineBits<W> notSolid, notCrossed;
+  for (int i = 0; i < W; i++) {
+    solid[i] &= cells[i];
+    notSolid[i] = cells[i] & ~solid[i];
+    notCrossed[i] = cells[i] & ~crossed[i];
+  }
+
+  uint64_t *prefix = solver_.words_.starts.data();
+  LineBits<W> next{};
+  next[0] = 1;
+  for (int k = 0; k < n_; k++) {
+    LineBits<W> f = fillRuns(next, notSolid);
+    LineBits<W> p = starts(notCrossed, solid, len(k));
+    for (int i = 0; i < W; i++) {
+      p[i] &= f[i];
+    }
+    if (!anyBit(p)) {
+      return false;
+    }
+    std::copy(p.begin(), p.end(), prefix + k * W);
+    next = shiftUp(p, len(k) + 1);
+  }
+
+  // the reversed line; bit i is cell n - 1 - i.
+  int shift = W * wordBits - n;
+  solid = shiftDown(reverseCells(solid), shift);
+  notSolid = shiftDown(reverseCells(notSolid), shift);
+  notCrossed = shiftDown(reverseCells(notCrossed), shift);
+  next = LineBits<W>{};
+  next[0] = 1;
+  for (int j = 0; j < n_; j++) {
+    int k = n_ - 1 - j;
+    LineBits<W> f = fillRuns(next, notSolid);
+    LineBits<W> p = starts(notCrossed, solid, len(k));
+    for (int i = 0; i < W; i++) {
+      p[i] &= f[i];
+    }
+    next = shiftUp(p, len(k) + 1);
+    // segment k at cell c starts at n - c - len(k) backward.
+    LineBits<W> fit = shiftDown(reverseCells(p), shift + len(k) - 1);
+    for (int i = 0; i < W; i++) {
+      fit[i] &= prefix[k * W + i];
+    }
+    if (!anyBit(fit)) {
+      return false;
+    }
+    left[k] = lowestBit(fit);
+    right[j] = n - highestBit(fit) - len(k);
+  }
+  return true;
+}
+
+template <int W>
+bool Line::inferSegmentsWords(int first, int last) {
+  LineBits<W> solid{}, crossed{};
+  int end = std::min(last + 1, numSegments());
+  for (int i = first; i < end; i++) {
+    int l = lb(i);
+    int u = ub(i);
+    int prevU = i > 0 ? ub(i - 1) : -1;
+    if (l + len(i) - 1 > u) {
+      return false;
+    }
+    setRange(crossed, prevU + 1, l);
+    if (done(i) || i == last) {
+      continue;
+    }
+    setRange(solid, u - len(i) + 1, l + len(i));
+    if (u - l + 1 == len(i)) {
+      setDone(i);
+    }
+  }
+  if (last == numSegments()) {
+    setRange(crossed, ub(last - 1) + 1, slice_.length());
+  }
+
+  // the cells are set in order, as setSegment does.
+  int words = slice_.words();
+  LineBits<W> isSolid = loadCells<W>(slice_.solidWords(), words);
+  LineBits<W> isCrossed = loadCells<W>(slice_.crossedWords(), words);
+  for (int i = 0; i < W; i++) {
+    uint64_t toSolid = solid[i] & ~isSolid[i];
+    uint64_t m = toSolid | (crossed[i] & ~isCrossed[i]);
+    for (; m != 0; m &= m - 1) {
+      int b = __builtin_ctzll(m);
+      slice_.set(i * wordBits + b, toSolid >> b & 1 ? CellState::SOLID
+                                                     : CellState::CROSSED);
+    }
+  }
+  return true;
+}
+
+bool Line::inferSegments(int first, int last) {
+  switch (words_) {
+    case 1:
+      return inferSegmentsWords<1>(first, last);
+    case 2:
+      return inferSegmentsWords<2>(first, last);
+    case maxFitWords:
+      return inferSegmentsWords<maxFitWords>(first, last);
+  }
+  // the gap after segment last - 1 is crossed before segment last.
+  int end = std::min(last + 1, numSegments());
+  for (int i = first; i < end; i++) {
     int l = lb(i);
     int u = ub(i);
     int prevU = i > 0 ? ub(i - 1) : -1;
@@ -198,7 +802,7 @@ bool Line::inferSegments() {
       slice_.setSegment(prevU + 1, l, CellState::CROSSED);
     }
 
-    if (done(i)) {
+    if (done(i) || i == last) {
       continue;
     }
 
@@ -207,10 +811,10 @@ bool Line::inferSegments() {
     }
 
     if (u - l + 1 == len(i)) {
-      done_[i] = true;
+      setDone(i);
     }
   }
-  if (ub(numSegments() - 1) + 1 < slice_.length()) {
+  if (last == numSegments() && ub(last - 1) + 1 < slice_.length()) {
     slice_.setSegment(ub(numSegments() - 1) + 1, slice_.length(),
                       CellState::CROSSED);
   }
@@ -218,25 +822,45 @@ bool Line::inferSegments() {
 }
 
 // returns a segment index ranges (left inclusive, right exclusive)
-// that lb(i) <= start and ub(i) >= end.
+// that lb(i) <= start and ub(i) >= end. Both bounds grow with i, so
+// these are the segments from the first one with ub(i) >= end up to
+// the first one after it with lb(i) > start.
 std::pair<int, int> Line::collidingSegments(int start, int end) {
-  int first = 0, second = 0;
-  bool found = false;
-  for (int i = 0; i < numSegments(); i++) {
-    if (ub(i) < end) {
-      continue;
+  int lo = 0, hi = numSegments();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ub(mid) < end) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    if (lb(i) <= start) {
-      if (!found) {
-        found = true;
-        first = i;
-      }
-      second = i + 1;
-    } else if (found) {
-      break;
+  }
+  int first = lo;
+  hi = numSegments();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lb(mid) <= start) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
-  return std::make_pair(first, second);
+  if (first == lo) {
+    return std::make_pair(0, 0);
+  }
+  return std::make_pair(first, lo);
+}
+
+int Line::shortest(int first, int last) const {
+  int j = 31 - __builtin_clz(last - first);
+  const uint16_t *t = minLen_ + j * n_;
+  return std::min(t[first], t[last - (1 << j)]);
+}
+
+int Line::longest(int first, int last) const {
+  int j = 31 - __builtin_clz(last - first);
+  const uint16_t *t = maxLen_ + j * n_;
+  return std::max(t[first], t[last - (1 << j)]);
 }
 
 // Make inference for strips (consecutive cells with same state).
@@ -245,10 +869,26 @@ std::pair<int, int> Line::collidingSegments(int start, int end) {
 // 1. "X X" can be marked "XXX" if all possible segments >= 2
 // 2. "?SSS?" can be marked "XSSSX" if all possible segments =3.
 // 3. "X SS " can be marked "X SSS" if all potential segments >= 4.
-bool Line::inferStrips() {
+//
+// A strip's rules read the cells up to the longest clue away from it,
+// so the strips looked at are those that reach that close to cells
+// [from, to) or to a cell changed since the bounds were fit, which
+// includes the cells set here.
+bool Line::inferStrips(int from, int to) {
+  from = std::min(from, int(changed_[0]));
+  to = std::max(to, int(changed_[1]));
+  if (from >= to) {
+    return true;
+  }
+  int length = slice_.length();
+  int reach = numSegments() > 0 ? longest(0, numSegments()) : 0;
   int stripLen = 0;
 
-  for (int i = 0; i < slice_.length(); i += stripLen) {
+  // start at the beginning of the strip that holds from - reach.
+  int i = std::max(from - reach, 0);
+  i -= slice_.reverse().stripLength(length - 1 - i) - 1;
+  for (; i < length && i < std::max(to, int(changed_[1])) + reach;
+       i += stripLen) {
     stripLen = slice_.stripLength(i);
     // this logic is never needed for slices at the edges
     if (i == 0 || i + stripLen == slice_.length()) {
@@ -266,14 +906,7 @@ bool Line::inferStrips() {
       if (seg.first == seg.second) {
         continue;
       }
-      int minLen = len(seg.first);
-      for (int j = seg.first; j < seg.second; j++) {
-        if (minLen > len(j)) {
-          minLen = len(j);
-        }
-      }
-
-      if (minLen <= stripLen) {
+      if (shortest(seg.first, seg.second) <= stripLen) {
         continue;
       }
 
@@ -286,16 +919,8 @@ bool Line::inferStrips() {
       if (seg.second - seg.first == 1 && done(seg.first)) {
         continue;
       }
-      int maxLen = len(seg.first);
-      int minLen = len(seg.first);
-      for (int j = seg.first; j < seg.second; j++) {
-        if (len(j) < minLen) {
-          minLen = len(j);
-        }
-        if (len(j) > maxLen) {
-          maxLen = len(j);
-        }
-      }
+      int minLen = shortest(seg.first, seg.second);
+      int maxLen = longest(seg.first, seg.second);
 
       for (int j = i + stripLen; j < i + minLen && j < slice_.length(); j++) {
         CellState s = slice_.get(j);
@@ -336,129 +961,1079 @@ bool Line::inferStrips() {
   return true;
 }
 
-bool Line::infer() {
-  // special case for no segments.
-  if (numSegments() == 0) {
-    slice_.setSegment(0, slice_.length(), CellState::CROSSED);
-    return true;
-  }
+// Exact line solver. Dynamic programming over (segment, position)
+// finds every placement of the segments consistent with the current
+// cells; a cell is set when it has the same state in all of them, and
+// the bounds become the extreme placements of each segment.
+//
+// The line is extended with a virtual crossed cell at n. F(k, p) holds
+// when segments [0, k) fit in cells [0, p) with the cell before p
+// crossed, so that segment k may start at p; B(k, p) holds when
+// segments [k, K) fit in cells [p, n + 1).
+bool Line::inferExact() {
+  int n = slice_.length();
+  int K = numSegments();
+  int w = n + 2;
+  auto &cells = solver_.exact_.cells;
+  auto &crossed = solver_.exact_.crossed;
+  auto &cover = solver_.exact_.cover;
+  auto &reach = solver_.exact_.reach;
+  auto &canCross = solver_.exact_.canCross;
+  auto &last = solver_.exact_.last;
+  auto &fit = solver_.fit_;
 
-  // update left and right bounts
-  if (!fitLeftMost(slice_, len_, lb_)) {
-    return false;
-  }
-  std::vector<int> len_reverse(len_);
-  std::reverse(len_reverse.begin(), len_reverse.end());
-  if (!fitLeftMost(slice_.reverse(), len_reverse, ub_)) {
-    return false;
+  cells.resize(n + 1);
+  crossed.resize(n + 2);
+  crossed[0] = 0;
+  for (int p = 0; p < n; p++) {
+    cells[p] = slice_.get(p);
+    crossed[p + 1] = crossed[p] + (cells[p] == CellState::CROSSED);
   }
-  updateStats();
-  if (!inferSegments()) {
-    return false;
+  cells[n] = CellState::CROSSED;
+  crossed[n + 1] = crossed[n] + 1;
+
+  // segment k can occupy [p, p + len(k)) followed by a cross.
+  auto fits = [&](int k, int p) {
+    int e = p + len(k);
+    return e <= n && crossed[e] == crossed[p] && cells[e] != CellState::SOLID;
+  };
+  auto F = [&](int k, int p) { return reach[k * w + p]; };
+  auto B = [&](int k, int p) { return reach[(K + 1 + k) * w + p]; };
+
+  reach.assign(2 * (K + 1) * w, false);
+  reach[0] = true;
+  for (int p = 0; p <= n; p++) {
+    for (int k = 0; k <= K; k++) {
+      if (!F(k, p)) {
+        continue;
+      }
+      if (cells[p] != CellState::SOLID) {
+        reach[k * w + p + 1] = true;
+      }
+      if (k < K && fits(k, p)) {
+        reach[(k + 1) * w + p + len(k) + 1] = true;
+      }
+    }
   }
-  if (!inferStrips()) {
+  if (!F(K, n + 1)) {
     return false;
   }
-  return true;
-}
 
-Line::State::State(const Line &l) : lb(l.lb_), ub(l.ub_), done(l.done_) {}
-
-Line::State Line::getState() const { return Line::State(*this); }
+  reach[(2 * K + 1) * w + n + 1] = true;
+  for (int p = n; p >= 0; p--) {
+    for (int k = 0; k <= K; k++) {
+      reach[(K + 1 + k) * w + p] =
+          (cells[p] != CellState::SOLID && B(k, p + 1)) ||
+          (k < K && fits(k, p) && B(k + 1, p + len(k) + 1));
+    }
+  }
 
-void Line::setState(Line::State &&s) {
-  lb_ = std::move(s.lb);
-  ub_ = std::move(s.ub);
-  done_ = std::move(s.done);
-}
+  // collect the cells that can be crossed or solid, and the bounds.
+  cover.assign(n + 1, 0);
+  canCross.assign(n, false);
+  last.assign(K, -1);
+  for (int k = 0; k <= K; k++) {
+    for (int p = 0; p <= n; p++) {
+      if (!F(k, p)) {
+        continue;
+      }
+      if (p < n && cells[p] != CellState::SOLID && B(k, p + 1)) {
+        canCross[p] = true;
+      }
+      if (k < K && fits(k, p) && B(k + 1, p + len(k) + 1)) {
+        cover[p]++;
+        cover[p + len(k)]--;
+        if (p + len(k) < n) {
+          canCross[p + len(k)] = true;
+        }
+        if (last[k] == -1) {
+          fit[k] = p;
+        }
+        last[k] = p;
+      }
+    }
+  }
 
-// Solver implementation
+  int solid = 0;
+  for (int p = 0; p < n; p++) {
+    solid += cover[p];
+    if (cells[p] != CellState::EMPTY) {
+      continue;
+    }
+    if (solid == 0) {
+      slice_.set(p, CellState::CROSSED);
+    } else if (!canCross[p]) {
+      slice_.set(p, CellState::SOLID);
+    }
+  }
 
-Solver::Solver(const Solver::Config &config,
-               std::vector<std::vector<int>> &&rows,
-               std::vector<std::vector<int>> &&cols)
-    : config_(config),
-      width_(cols.size()),
-      height_(rows.size()),
-      g_(cols.size() * rows.size(), CellState::EMPTY) {
-  for (int i = 0; i < height_; i++) {
-    lines_.push_back(
-        std::make_unique<Line>(*this, LineName::Row(i), std::move(rows[i])));
-    dirty_.push_back(LineName::Row(i));
+  int oldFirst = lb(0), oldLast = ub(K - 1);
+  auto left = commitBounds(lb_, 0);
+  for (int k = 0; k < K; k++) {
+    fit[K - 1 - k] = n - last[k] - len(k);
+  }
+  auto right = commitBounds(ub_, K);
+  bool moved = left.first < left.second || right.first < right.second;
+  for (int k = 0; k < K; k++) {
+    if (!done(k) && ub(k) - lb(k) + 1 == len(k)) {
+      setDone(k);
+      moved = true;
+    }
   }
-  for (int i = 0; i < width_; i++) {
-    lines_.push_back(
-        std::make_unique<Line>(*this, LineName::Column(i), std::move(cols[i])));
-    dirty_.push_back(LineName::Column(i));
+  if (moved) {
+    boundsMoved(oldFirst, oldLast);
   }
+  updateStats();
+  return true;
 }
 
-void Solver::set(int x, int y, CellState val) {
-  if (val == get(x, y)) {
-    return;
-  }
-  if (get(x, y) != CellState::EMPTY) {
-    failed_ = true;
-    return;
+template <typename S, typename R>
+bool Line::fitBounds(const S &forward, const R &backward,
+                     std::pair<int, int> *woken, std::pair<int, int> *cells) {
+  int length = slice_.length();
+  int from = changed_[0];
+  int to = changed_[1];
+  if (to > length || !solver_.config_.incrementalFit) {
+    from = 0;
+    to = length + 2;
   }
+  // the cells changed from here on are left for the next fit.
+  int line = solver_.lineIndex(name);
+  solver_.trail(line, 3 * n_, changed_[0]);
+  solver_.trail(line, 3 * n_ + 1, changed_[1]);
+  changed_[0] = length;
+  changed_[1] = 0;
 
-  g_[x + y * width_] = val;
-  if (lineName_.dir != Direction::ROW) {
-    markDirty(LineName::Row(y));
-  }
-  if (lineName_.dir != Direction::COLUMN) {
-    markDirty(LineName::Column(x));
+  // a few changed cells wake a few segments, which the incremental fit
+  // refits alone; the masks refit all of them, so they take full fits.
+  bool all = to > length;
+  int words = all ? words_ : 0;
+  int *fit = solver_.fit_.data();
+  int *back = solver_.words_.right.data();
+  bool ok = true;
+  switch (words) {
+    case 1:
+      ok = fitWords<1>(fit, back);
+      break;
+    case 2:
+      ok = fitWords<2>(fit, back);
+      break;
+    case maxFitWords:
+      ok = fitWords<maxFitWords>(fit, back);
+      break;
+    default:
+      std::copy(lb_, lb_ + n_, fit);
+      ok = fitLeftMost(forward, len_, n_, fit, from, to);
   }
-};
-
-void Solver::markDirty(LineName n) {
-  auto f = std::find(dirty_.begin(), dirty_.end(), n);
-  if (f == dirty_.end()) {
-    dirty_.push_back(n);
-    getLine(n).stats.numChanges++;
+  if (!ok) {
+    return false;
+  }
+  int oldLeft;
+  auto left = commitBounds(lb_, 0, &oldLeft);
+  if (words > 0) {
+    std::copy(back, back + n_, fit);
+  } else {
+    std::copy(ub_, ub_ + n_, fit);
+    if (!fitLeftMost(backward, len_ + n_, n_, fit, all ? 0 : length - to,
+                     all ? to : length - from)) {
+      return false;
+    }
+  }
+  // ub_ is in backward order.
+  int oldRight;
+  auto right = commitBounds(ub_, n_, &oldRight);
+  if (all) {
+    // the cells were never set from these bounds.
+    *woken = std::make_pair(0, n_);
+    *cells = std::make_pair(0, length);
+    return true;
+  }
+  *woken = std::make_pair(std::min(left.first, n_ - right.second),
+                          std::max(left.second, n_ - right.first));
+  *cells = std::make_pair(from, to);
+  if (woken->first < woken->second) {
+    // windows only shrink, and they grow with the segment index, so the
+    // old windows of the woken segments lie between the old lb of the
+    // first one and the old ub of the last one.
+    int first = woken->first;
+    int last = woken->second - 1;
+    int lo = first == left.first ? oldLeft : lb(first);
+    int hi = last == n_ - 1 - right.first ? length - oldRight - 1 : ub(last);
+    cells->first = std::min(cells->first, lo);
+    cells->second = std::max(cells->second, hi + 1);
+  }
+  return true;
+}
+
+bool Line::fit() {
+  std::pair<int, int> woken, cells;
+  return fitBounds(slice_, slice_.reverse(), &woken, &cells);
+}
+
+// Only the segments woken by the changed cells are refit and applied,
+// and only the strips near what changed are looked at again. Any other
+// strip has the same cells around it and the same colliding segments
+// as when it was last looked at, so it would not set anything either.
+bool Line::inferHeuristic() {
+  // update left and right bounds
+  std::pair<int, int> woken, cells;
+  if (!fitBounds(slice_, slice_.reverse(), &woken, &cells)) {
+    return false;
+  }
+  updateStats();
+  if (woken.first < woken.second &&
+      !inferSegments(woken.first, woken.second)) {
+    return false;
+  }
+  if (!inferStrips(cells.first, cells.second)) {
+    return false;
+  }
+  return true;
+}
+
+bool Line::inferEngine() {
+  switch (solver_.config_.lineSolver) {
+    case LineSolver::HEURISTIC:
+      return inferHeuristic();
+    case LineSolver::EXACT:
+      return inferExact();
+    case LineSolver::HYBRID: {
+      long numSet;
+      do {
+        numSet = solver_.numSet_;
+        if (!inferHeuristic()) {
+          return false;
+        }
+      } while (solver_.numSet_ != numSet);
+      if (slice_.indexOfNextEmpty(0) == -1) {
+        return true;
+      }
+      return inferExact();
+    }
+  }
+  return true;
+}
+
+// Looks the line up in the cache and replays a hit onto the cells and
+// bounds. On a miss the engine runs and its outcome is recorded: the
+// solid and crossed words, then lb_, ub_ and done_.
+bool Line::inferCached(LineCache &cache) {
+  LineCache::Key &key = solver_.cacheKey_;
+  LineCache::Result &result = solver_.cacheResult_;
+  int words = slice_.words();
+  int n = numSegments();
+  const uint64_t *solid = slice_.solidWords();
+  const uint64_t *crossed = slice_.crossedWords();
+
+  key.clear();
+  key.push_back(slice_.length());
+  key.push_back(static_cast<uint64_t>(solver_.config_.lineSolver));
+  key.insert(key.end(), len_, len_ + n);
+  key.insert(key.end(), solid, solid + words);
+  key.insert(key.end(), crossed, crossed + words);
+  // the heuristics start from the current bounds and do not always
+  // reach the same result from different ones.
+  if (solver_.config_.lineSolver != LineSolver::EXACT) {
+    key.insert(key.end(), lb_, lb_ + 3 * n);
+  }
+
+  solver_.stats_.cacheLookups++;
+  if (cache.lookup(key, &result)) {
+    solver_.stats_.cacheHits++;
+    if (!result.ok) {
+      return false;
+    }
+    const uint64_t *v = result.value.data();
+    for (int k = 0; k < words; k++) {
+      uint64_t s = v[k] & ~solid[k];
+      uint64_t c = v[words + k] & ~crossed[k];
+      for (; s != 0; s &= s - 1) {
+        slice_.set(k * wordBits + __builtin_ctzll(s) - gridHalfEdge,
+                   CellState::SOLID);
+      }
+      for (; c != 0; c &= c - 1) {
+        slice_.set(k * wordBits + __builtin_ctzll(c) - gridHalfEdge,
+                   CellState::CROSSED);
+      }
+    }
+    v += 2 * words;
+    int oldFirst = lb(0), oldLast = ub(n - 1);
+    std::copy(v, v + n, solver_.fit_.begin());
+    auto left = commitBounds(lb_, 0);
+    std::copy(v + n, v + 2 * n, solver_.fit_.begin());
+    auto right = commitBounds(ub_, n);
+    bool moved = left.first < left.second || right.first < right.second;
+    for (int i = 0; i < n; i++) {
+      if (v[2 * n + i] && !done(i)) {
+        setDone(i);
+        moved = true;
+      }
+    }
+    if (moved) {
+      boundsMoved(oldFirst, oldLast);
+    }
+    updateStats();
+    return true;
+  }
+
+  // a crossing line that the engine filled up against its clue fails
+  // in set(), but that is no contradiction of this key; replaying the
+  // cells finds it again.
+  long numConflicts = solver_.numConflicts_;
+  result.ok = inferEngine() && solver_.numConflicts_ == numConflicts;
+  result.value.assign(solid, solid + words);
+  result.value.insert(result.value.end(), crossed, crossed + words);
+  result.value.insert(result.value.end(), lb_, lb_ + 3 * n);
+  cache.insert(key, result);
+  return result.ok;
+}
+
+bool Line::infer() {
+  // a full line was verified when its last cell was set.
+  if (solver_.emptyCells(name) == 0) {
+    return true;
+  }
+  // special case for no segments.
+  if (numSegments() == 0) {
+    slice_.setSegment(0, slice_.length(), CellState::CROSSED);
+    return true;
+  }
+
+  LineCache *cache = solver_.config_.cache.get();
+  if (cache != nullptr) {
+    return inferCached(*cache);
+  }
+  return inferEngine();
+}
+
+bool Line::verify() const {
+  int i = 0;
+  for (int k = 0; k < n_; k++) {
+    int l = len_[k];
+    if (l == 0) {
+      continue;
+    }
+    i = slice_.indexOfNextSolid(i, slice_.length());
+    if (i < 0 || slice_.stripLength(i) != l) {
+      return false;
+    }
+    i += l;
+  }
+  return slice_.indexOfNextSolid(i, slice_.length()) < 0;
+}
+
+std::pair<int, int> Line::commitBounds(uint16_t *bounds, int slot0,
+                                       int *old) {
+  int line = solver_.lineIndex(name);
+  const int *fit = solver_.fit_.data();
+  int first = n_, last = 0;
+  for (int i = 0; i < n_; i++) {
+    if (bounds[i] != fit[i]) {
+      if (first == n_ && old != nullptr) {
+        *old = bounds[i];
+      }
+      solver_.trail(line, slot0 + i, bounds[i]);
+      bounds[i] = fit[i];
+      first = std::min(first, i);
+      last = i + 1;
+    }
+  }
+  return std::make_pair(first, last);
+}
+
+void Line::boundsMoved(int oldFirst, int oldLast) {
+  changed(oldFirst);
+  changed(oldLast);
+}
+
+void Line::changed(int i) {
+  int line = solver_.lineIndex(name);
+  if (i < changed_[0]) {
+    solver_.trail(line, 3 * n_, changed_[0]);
+    changed_[0] = i;
+  }
+  if (i >= changed_[1]) {
+    solver_.trail(line, 3 * n_ + 1, changed_[1]);
+    changed_[1] = i + 1;
+  }
+}
+
+void Line::setDone(int i) {
+  solver_.trail(solver_.lineIndex(name), 2 * numSegments() + i, false);
+  done_[i] = true;
+}
+
+// DirtyQueue implementation
+
+DirtyQueue::DirtyQueue(int numLines) { reset(numLines); }
+
+void DirtyQueue::reset(int numLines) {
+  heap_.clear();
+  heap_.reserve(numLines);
+  key_.resize(numLines);
+  pos_.assign(numLines, -1);
+}
+
+void DirtyQueue::swap(int i, int j) {
+  std::swap(heap_[i], heap_[j]);
+  pos_[heap_[i]] = i;
+  pos_[heap_[j]] = j;
+}
+
+void DirtyQueue::siftUp(int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (key_[heap_[parent]] >= key_[heap_[i]]) {
+      return;
+    }
+    swap(i, parent);
+    i = parent;
+  }
+}
+
+void DirtyQueue::siftDown(int i) {
+  int n = heap_.size();
+  while (true) {
+    int largest = i;
+    int l = 2 * i + 1;
+    int r = l + 1;
+    if (l < n && key_[heap_[l]] > key_[heap_[largest]]) {
+      largest = l;
+    }
+    if (r < n && key_[heap_[r]] > key_[heap_[largest]]) {
+      largest = r;
+    }
+    if (largest == i) {
+      return;
+    }
+    swap(i, largest);
+    i = largest;
+  }
+}
+
+void DirtyQueue::push(int line, double key) {
+  key_[line] = key;
+  pos_[line] = heap_.size();
+  heap_.push_back(line);
+  siftUp(heap_.size() - 1);
+}
+
+int DirtyQueue::pop() {
+  int line = heap_.front();
+  swap(0, heap_.size() - 1);
+  heap_.pop_back();
+  pos_[line] = -1;
+  siftDown(0);
+  return line;
+}
+
+void DirtyQueue::clear() {
+  for (int line : heap_) {
+    pos_[line] = -1;
+  }
+  heap_.clear();
+}
+
+// Solver implementation
+
+void Solver::Stats::add(const Stats &o) {
+  lineCount += o.lineCount;
+  wrongGuesses += o.wrongGuesses;
+  maxDepth = std::max(maxDepth, o.maxDepth);
+  cacheLookups += o.cacheLookups;
+  cacheHits += o.cacheHits;
+  probes += o.probes;
+  probeFixed += o.probeFixed;
+  peakStateBytes = std::max(peakStateBytes, o.peakStateBytes);
+}
+
+// Shared state of a parallel search over one puzzle. An open subtree
+// is a clone of a solver with one guess set the other way; the solver
+// that made the guess goes on without a choice point for it. Workers
+// take open subtrees, and hand out branches of their own while other
+// workers are idle, so every subtree is searched exactly once.
+struct Solver::Search {
+  const Config &config;
+  std::mutex mutex;  // guards the members below
+  std::condition_variable changed;
+  std::deque<std::unique_ptr<Solver>> open;
+  int busy = 0;  // solvers searching a subtree
+  std::vector<std::thread> threads;
+  std::unique_ptr<Solver> solution;
+  Stats stats;  // of the finished helper solvers
+  bool timedOut = false;     // a helper solver ran out of time
+  bool outOfMemory = false;  // or went over config.maxStateBytes
+
+  std::atomic<bool> done{false};  // a solution was found
+  std::atomic<int> idle{0};       // workers waiting for a subtree
+  std::atomic<int> queued{0};     // open.size()
+
+  explicit Search(const Config &c) : config(c) {}
+
+  // waits for an open subtree. Returns null when a solution was found
+  // or everything has been searched.
+  std::unique_ptr<Solver> take() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle++;
+    changed.wait(lock, [this] { return done || !open.empty() || busy == 0; });
+    idle--;
+    if (done || open.empty()) {
+      return nullptr;
+    }
+    auto s = std::move(open.front());
+    open.pop_front();
+    queued--;
+    busy++;
+    return s;
+  }
+
+  void finish(std::unique_ptr<Solver> s, bool solved) {
+    std::lock_guard<std::mutex> g(mutex);
+    busy--;
+    stats.add(s->stats_);
+    timedOut = timedOut || s->timedOut_;
+    outOfMemory = outOfMemory || s->outOfMemory_;
+    if (solved && !done) {
+      done = true;
+      solution = std::move(s);
+    }
+    changed.notify_all();
+  }
+
+  void work() {
+    for (auto s = take(); s; s = take()) {
+      bool solved = s->search();
+      finish(std::move(s), solved);
+    }
+  }
+
+  // starts another worker if the thread limits allow it.
+  bool startWorker() {
+    std::lock_guard<std::mutex> g(mutex);
+    if (done || static_cast<int>(threads.size()) + 1 >= config.threads) {
+      return false;
+    }
+    if (config.budget != nullptr && !config.budget->TryAcquire()) {
+      return false;
+    }
+    threads.emplace_back([this] {
+      work();
+      if (config.budget != nullptr) {
+        config.budget->Release();
+      }
+    });
+    return true;
   }
 };
 
-LineName Solver::getDirty() {
-  std::sort(dirty_.begin(), dirty_.end(),
-            [this](LineName a, LineName b) -> bool {
-              auto sa = config_.LineScore(this->getLine(a).stats);
-              auto sb = config_.LineScore(this->getLine(b).stats);
-              return sa < sb;
-            });
-  auto n = dirty_.back();
-  dirty_.pop_back();
-  return n;
+bool Solver::validPuzzle(const std::vector<std::vector<int>> &rows,
+                         const std::vector<std::vector<int>> &cols) {
+  if (rows.size() > size_t(maxLineLength) ||
+      cols.size() > size_t(maxLineLength)) {
+    return false;
+  }
+  for (auto *lines : {&rows, &cols}) {
+    for (auto &clues : *lines) {
+      for (int c : clues) {
+        if (c < 0 || c > maxClue) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+Solver::Solver(const Solver::Config &config,
+               std::vector<std::vector<int>> &&rows,
+               std::vector<std::vector<int>> &&cols)
+    : config_(config), g_(0, 0), dirty_(0) {
+  const Layer &l = config_.n->layer(0);
+  accDim_ = l.dim_out();
+  // cell values are -1, 0 or 1, so a sum is at most the sum of the
+  // absolute weights of its unit.
+  double most = 0;
+  for (int o = 0; o < accDim_; o++) {
+    double sum = 0;
+    for (int k = 0; k < gridSize; k++) {
+      sum += std::abs(l.weight(o, k));
+    }
+    most = std::max(most, sum);
+  }
+  accScale_ = most > 0 ? std::exp2(std::floor(std::log2((1 << 30) / most)))
+                       : 1;
+  accWeights_.resize(gridSize * accDim_);
+  for (int k = 0; k < gridSize; k++) {
+    for (int o = 0; o < accDim_; o++) {
+      accWeights_[k * accDim_ + o] = std::lround(l.weight(o, k) * accScale_);
+    }
+  }
+  reset(rows, cols);
+}
+
+void Solver::reset(const std::vector<std::vector<int>> &rows,
+                   const std::vector<std::vector<int>> &cols) {
+  width_ = cols.size();
+  height_ = rows.size();
+  g_.reset(width_, height_);
+  lineName_ = LineName();
+  failed_ = false;
+  numSet_ = 0;
+  numConflicts_ = 0;
+  guessed_ = Guess::Empty();
+  stats_ = Stats();
+  timedOut_ = false;
+  outOfMemory_ = false;
+  states_.clear();
+  trail_.clear();
+  literals_.clear();
+  numSnapshots_ = 0;
+  trailing_ = false;
+  lineage_ = 0;
+  scoring_ = false;
+
+  int numLines = height_ + width_;
+  arena_.first.resize(numLines + 1);
+  arena_.first[0] = 0;
+  for (int i = 0; i < numLines; i++) {
+    auto &len = i < height_ ? rows[i] : cols[i - height_];
+    arena_.first[i + 1] = arena_.first[i] + len.size();
+  }
+  int segments = arena_.first[numLines];
+  arena_.clues.resize(2 * segments);
+  arena_.bounds.assign(3 * segments + 2 * numLines, 0);
+  size_t longest = 0;
+  for (int i = 0; i < numLines; i++) {
+    auto &len = i < height_ ? rows[i] : cols[i - height_];
+    uint16_t *clues = arena_.clues.data() + 2 * arena_.first[i];
+    std::copy(len.begin(), len.end(), clues);
+    std::reverse_copy(len.begin(), len.end(), clues + len.size());
+    longest = std::max(longest, len.size());
+  }
+  fit_.resize(longest);
+  words_.starts.resize(longest * maxFitWords);
+  words_.right.resize(longest);
+
+  arena_.tableFirst.resize(numLines);
+  size_t tables = 0;
+  for (int i = 0; i < numLines; i++) {
+    int n = arena_.first[i + 1] - arena_.first[i];
+    arena_.tableFirst[i] = tables;
+    tables += 2 * tableLevels(n) * n;
+  }
+  arena_.lenTables.resize(tables);
+  for (int i = 0; i < numLines; i++) {
+    int n = arena_.first[i + 1] - arena_.first[i];
+    int levels = tableLevels(n);
+    const uint16_t *clues = arena_.clues.data() + 2 * arena_.first[i];
+    uint16_t *shortest = arena_.lenTables.data() + arena_.tableFirst[i];
+    uint16_t *longest = shortest + levels * n;
+    std::copy(clues, clues + n, shortest);
+    std::copy(clues, clues + n, longest);
+    for (int j = 1; j < levels; j++) {
+      int half = 1 << (j - 1);
+      for (int k = 0; k + 2 * half <= n; k++) {
+        shortest[j * n + k] = std::min(shortest[(j - 1) * n + k],
+                                       shortest[(j - 1) * n + k + half]);
+        longest[j * n + k] = std::max(longest[(j - 1) * n + k],
+                                      longest[(j - 1) * n + k + half]);
+      }
+    }
+  }
+
+  lines_.clear();
+  lines_.reserve(numLines);
+  dirty_.reset(numLines);
+  for (int i = 0; i < numLines; i++) {
+    lines_.emplace_back(*this, lineName(i));
+    dirty_.push(i, config_.LineScore(lines_.back().stats));
+  }
+  resetCells();
+}
+
+Solver::Solver(const Solver &other, Fork)
+    : config_(other.config_),
+      width_(other.width_),
+      height_(other.height_),
+      g_(other.g_),
+      numSet_(other.numSet_),
+      arena_(other.arena_),
+      fit_(other.fit_.size()),
+      words_{std::vector<uint64_t>(other.words_.starts.size()),
+             std::vector<int>(other.words_.right.size())},
+      cancel_(other.cancel_),
+      dirty_(other.lines_.size()),
+      accDim_(other.accDim_),
+      accScale_(other.accScale_),
+      accWeights_(other.accWeights_),
+      acc_(other.scoring_ ? other.acc_ : std::vector<int32_t>()),
+      scoring_(other.scoring_),
+      open_(other.open_),
+      openPos_(other.openPos_),
+      numOpen_(other.numOpen_),
+      emptyCount_(other.emptyCount_),
+      search_(other.search_),
+      lineage_(other.lineage_ + other.stats_.lineCount),
+      deadline_(other.deadline_) {
+  lines_.reserve(other.lines_.size());
+  for (const Line &l : other.lines_) {
+    lines_.emplace_back(*this, l);
+  }
+  if (scoring_) {
+    resetCandidates();
+  }
+}
+
+std::unique_ptr<Solver> Solver::clone() const {
+  return std::unique_ptr<Solver>(new Solver(*this, Fork()));
+}
+
+void Solver::resetScores() {
+  acc_.assign(width_ * height_ * accDim_, 0);
+  for (int x = 0; x < width_; x++) {
+    for (int y = 0; y < height_; y++) {
+      int32_t *a = &acc_[(x + y * width_) * accDim_];
+      for (int k = 0; k < gridSize; k++) {
+        int v = g_.value(x + k / gridEdge - gridHalfEdge,
+                         y + k % gridEdge - gridHalfEdge);
+        for (int o = 0; o < accDim_; o++) {
+          a[o] += v * accWeights_[k * accDim_ + o];
+        }
+      }
+    }
+  }
+  resetCandidates();
+}
+
+void Solver::resetCells() {
+  // the EMPTY cells first, then the set ones.
+  int cells = width_ * height_;
+  open_.resize(cells);
+  openPos_.resize(cells);
+  emptyCount_.assign(height_ + width_, 0);
+  numOpen_ = 0;
+  int n = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int c = 0; c < cells; c++) {
+      int x = c % width_;
+      int y = c / width_;
+      bool empty = get(x, y) == CellState::EMPTY;
+      if (empty != (pass == 0)) {
+        continue;
+      }
+      open_[n] = c;
+      openPos_[c] = n++;
+      if (empty) {
+        numOpen_++;
+        emptyCount_[y]++;
+        emptyCount_[height_ + x]++;
+      }
+    }
+  }
+  if (scoring_) {
+    resetScores();
+  }
+}
+
+void Solver::set(int x, int y, CellState val) {
+  if (val == get(x, y)) {
+    return;
+  }
+  if (get(x, y) != CellState::EMPTY) {
+    failed_ = true;
+    numConflicts_++;
+    return;
+  }
+
+  g_.set(x, y, val);
+  if (scoring_) {
+    accumulate(x, y, val == CellState::SOLID ? 1 : -1);
+  }
+  numSet_++;
+
+  int c = x + y * width_;
+  int last = open_[--numOpen_];
+  std::swap(open_[openPos_[c]], open_[numOpen_]);
+  openPos_[last] = openPos_[c];
+  openPos_[c] = numOpen_;
+  if (--emptyCount_[y] == 0 && !getLine(LineName::Row(y)).verify()) {
+    failed_ = true;
+  }
+  if (--emptyCount_[height_ + x] == 0 &&
+      !getLine(LineName::Column(x)).verify()) {
+    failed_ = true;
+  }
+  if (trailing_) {
+    trail_.push_back(TrailEntry{-1, x + y * width_, 0});
+  }
+  markDirty(LineName::Row(y), x);
+  markDirty(LineName::Column(x), y);
 };
 
-void Solver::pushState() {
-  Solver::State s;
-  s.g = g_;
-  s.guessed = guessed_;
-  for (int i = 0; i < lines_.size(); i++) {
-    s.lines.push_back(lines_[i]->getState());
+void Solver::accumulate(int x, int y, int sign) {
+  for (int i = -gridHalfEdge; i <= gridHalfEdge; i++) {
+    for (int j = -gridHalfEdge; j <= gridHalfEdge; j++) {
+      // x,y is at offset i,j in the pattern of cell cx,cy.
+      int cx = x - i;
+      int cy = y - j;
+      if (cx < 0 || cx >= width_ || cy < 0 || cy >= height_) {
+        continue;
+      }
+      int k = (i + gridHalfEdge) * gridEdge + j + gridHalfEdge;
+      int32_t *a = &acc_[(cx + cy * width_) * accDim_];
+      const int32_t *w = &accWeights_[k * accDim_];
+      for (int o = 0; o < accDim_; o++) {
+        a[o] += sign * w[o];
+      }
+      markStale(cx + cy * width_);
+    }
   }
+}
 
+void Solver::markStale(int cell) {
+  if (!stale_[cell]) {
+    staleCells_.push_back(cell);
+  }
+  stale_[cell] = true;
+}
+
+bool Solver::outdated(const Candidate &k) const {
+  int c = cellOf(k);
+  return k.stamp != stamp_[c] ||
+         get(c % width_, c / width_) != CellState::EMPTY;
+}
+
+void Solver::resetCandidates() {
+  int cells = width_ * height_;
+  candidates_.clear();
+  stamp_.assign(cells, 0);
+  stale_.assign(cells, 0);
+  staleCells_.clear();
+  for (int c = 0; c < cells; c++) {
+    markStale(c);
+  }
+  lineScores_.resize(lines_.size());
+  for (size_t i = 0; i < lines_.size(); i++) {
+    lineScores_[i] = config_.LineScore(lines_[i].stats);
+  }
+}
+
+// rescores the stale cells that are empty and pushes them as new
+// candidates.
+void Solver::updateCandidates() {
+  if (!scoring_) {
+    scoring_ = true;
+    resetScores();
+  }
+  for (size_t i = 0; i < lines_.size(); i++) {
+    if (emptyCount_[i] == 0) {
+      continue;
+    }
+    double score = config_.LineScore(lines_[i].stats);
+    if (score == lineScores_[i]) {
+      continue;
+    }
+    lineScores_[i] = score;
+    LineName n = lineName(i);
+    int len = n.dir == Direction::ROW ? width_ : height_;
+    for (int j = 0; j < len; j++) {
+      int x = n.dir == Direction::ROW ? j : n.index;
+      int y = n.dir == Direction::ROW ? n.index : j;
+      if (get(x, y) == CellState::EMPTY) {
+        markStale(x + y * width_);
+      }
+    }
+  }
+
+  // stale cells are scored by the net in batches, starting from the
+  // first layer outputs in acc_; a batch bounds the scratch space on
+  // large grids. Running the rest of the net again is cheaper than
+  // keeping its outputs for the cells whose line changed.
+  constexpr int batchSize = 1024;
+  const Layer &first = config_.n->layer(0);
+  int dimOut = config_.n->dim_out();
+  patterns_.resize(batchSize * accDim_);
+  batchCells_.clear();
+  for (size_t i = 0; i < staleCells_.size(); i++) {
+    int c = staleCells_[i];
+    stale_[c] = false;
+    if (get(c % width_, c / width_) == CellState::EMPTY) {
+      const int32_t *a = &acc_[c * accDim_];
+      double *h = &patterns_[batchCells_.size() * accDim_];
+      for (int o = 0; o < accDim_; o++) {
+        double v = -first.threshold(o) + a[o] / accScale_;
+        h[o] = v > 0 ? v : 0;
+      }
+      batchCells_.push_back(c);
+    }
+    if (batchCells_.size() < batchSize && i + 1 < staleCells_.size()) {
+      continue;
+    }
+    config_.n->evaluateBatch(patterns_.data(), batchCells_.size(),
+                             &patternScores_, &netScratch_, 1);
+    for (size_t b = 0; b < batchCells_.size(); b++) {
+      int c = batchCells_[b];
+      int x = c % width_;
+      int y = c / width_;
+      stamp_[c] = (stamp_[c] + 1) % (1u << 31);
+      Candidate k{.order = x * height_ + y, .stamp = stamp_[c]};
+      CellState val;
+      std::tie(k.score, val) =
+          config_.GuessScore(*this, x, y, &patternScores_[b * dimOut]);
+      k.crossed = val == CellState::CROSSED;
+      candidates_.push_back(k);
+      std::push_heap(candidates_.begin(), candidates_.end());
+    }
+    batchCells_.clear();
+  }
+  staleCells_.clear();
+
+  // drop outdated entries once they outnumber the open cells, each of
+  // which has at most one entry that is not.
+  if (candidates_.size() > 2 * size_t(numOpen_) + batchSize) {
+    auto outdated = [this](const Candidate &k) { return this->outdated(k); };
+    candidates_.erase(
+        std::remove_if(candidates_.begin(), candidates_.end(), outdated),
+        candidates_.end());
+    std::make_heap(candidates_.begin(), candidates_.end());
+  }
+}
+
+// The key of a queued line stays exact: a line's stats only change
+// when it is examined, at which point it has been popped. A line that
+// fills up is queued like any other, so that the open lines keep their
+// order among the queued ones; set() has verified it, and examining it
+// does nothing. While a line is examined, the lines in its direction
+// only record the change.
+void Solver::markDirty(LineName n, int index) {
+  int i = lineIndex(n);
+  lines_[i].changed(index);
+  if (n.dir == lineName_.dir) {
+    return;
+  }
+  if (!dirty_.contains(i)) {
+    Line &line = getLine(n);
+    line.stats.numChanges++;
+    dirty_.push(i, config_.LineScore(line.stats));
+  }
+};
+
+LineName Solver::getDirty() { return lineName(dirty_.pop()); };
+
+void Solver::pushState() {
+  State s{trail_.size(), guessed_, true, -1, literals_.size()};
+  int k = config_.recomputeEvery;
+  if (k > 0) {
+    s.trailed = false;
+    if (states_.size() % k == 0) {
+      s.snapshot = takeSnapshot();
+    }
+  }
   states_.push_back(s);
-  if (stats_.maxDepth < states_.size()) {
+  trailing_ = s.trailed;
+  if (stats_.maxDepth < int(states_.size())) {
     stats_.maxDepth = states_.size();
   }
+  stats_.peakStateBytes = std::max(stats_.peakStateBytes, stateBytes());
 }
 
 void Solver::popState() {
+  // the trail is longest right before it is undone.
+  stats_.peakStateBytes = std::max(stats_.peakStateBytes, stateBytes());
   Solver::State &s = states_.back();
-  g_ = std::move(s.g);
+  if (!s.trailed) {
+    recompute();
+    return;
+  }
+  while (trail_.size() > s.trailMark) {
+    TrailEntry &e = trail_.back();
+    if (e.line < 0) {
+      int x = e.index % width_;
+      int y = e.index / width_;
+      if (scoring_) {
+        accumulate(x, y, get(x, y) == CellState::SOLID ? -1 : 1);
+      }
+      g_.clear(x, y);
+      numOpen_++;  // the cell is open_[numOpen_ - 1] again
+      emptyCount_[y]++;
+      emptyCount_[height_ + x]++;
+    } else {
+      lines_[e.line].undo(e.index, e.old);
+    }
+    trail_.pop_back();
+  }
   guessed_ = s.guessed;
-  for (int i = 0; i < lines_.size(); i++) {
-    lines_[i]->setState(std::move(s.lines[i]));
+  dirty_.clear();
+  states_.pop_back();
+  trailing_ = !states_.empty() && states_.back().trailed;
+}
+
+int Solver::takeSnapshot() {
+  if (numSnapshots_ == int(snapshots_.size())) {
+    snapshots_.push_back(Snapshot{g_, arena_.bounds});
+  } else {
+    snapshots_[numSnapshots_].grid.assign(g_);
+    snapshots_[numSnapshots_].bounds = arena_.bounds;
   }
+  return numSnapshots_++;
+}
+
+// Restores the nearest snapshot at or below the top choice point, pops
+// the choice point and replays the cells decided between the two. The
+// replay propagates like the original did, though it may not reach the
+// very same bounds. If it fails, the choice point below is infeasible
+// as well, and failed_ is set.
+void Solver::recompute() {
+  State s = states_.back();
+  int j = states_.size() - 1;
+  while (states_[j].snapshot < 0) {
+    j--;
+  }
+  const Snapshot &snap = snapshots_[states_[j].snapshot];
+  g_.assign(snap.grid);
+  arena_.bounds = snap.bounds;
+  resetCells();
+  size_t from = states_[j].literalMark;
+  if (s.snapshot >= 0) {
+    numSnapshots_--;
+  }
+
+  guessed_ = s.guessed;
   dirty_.clear();
   states_.pop_back();
+  trailing_ = !states_.empty() && states_.back().trailed;
+  for (size_t i = from; i < s.literalMark; i++) {
+    const Guess &g = literals_[i];
+    set(g.x, g.y, g.val);
+    if (!infer() || failed_) {
+      failed_ = true;
+      break;
+    }
+  }
+  literals_.resize(s.literalMark);
+}
+
+long Solver::stateBytes() const {
+  long bytes = trail_.size() * sizeof(TrailEntry) +
+               states_.size() * sizeof(State) +
+               literals_.size() * sizeof(Guess);
+  for (int i = 0; i < numSnapshots_; i++) {
+    const Snapshot &snap = snapshots_[i];
+    bytes += snap.grid.bytes() + snap.bounds.size() * sizeof(uint16_t);
+  }
+  return bytes;
+}
+
+void Solver::decide(int x, int y, CellState val) {
+  if (!states_.empty() && !states_.back().trailed) {
+    literals_.push_back(Guess{x, y, val});
+  }
+  set(x, y, val);
 }
 
 // make inference on lines until all lines are checked.
 bool Solver::infer() {
-  while (dirty_.size() > 0) {
+  while (!dirty_.empty()) {
     lineName_ = getDirty();
     Line &line = getLine(lineName_);
     if (!line.infer()) {
@@ -466,15 +2041,18 @@ bool Solver::infer() {
     };
     stats_.lineCount++;
     lineName_.dir = Direction::EMPTY;
-    if (failed_ || stats_.lineCount >= config_.maxLines) {
+    // in a parallel search, maxLines applies to each path from the
+    // root, as in a serial search.
+    if (failed_ || lineage_ + stats_.lineCount >= config_.maxLines ||
+        stopped()) {
       return false;
     }
   }
   return true;
 }
 
-std::pair<double, CellState> Solver::Config::GuessScore(const Solver &s, int x,
-                                                        int y) const {
+std::pair<double, CellState> Solver::Config::GuessScore(
+    const Solver &s, int x, int y, const double *pattern_score) const {
   double score = LineScore(s.getLine(LineName::Row(y)).stats) * rowCoef +
                  LineScore(s.getLine(LineName::Column(x)).stats) * colCoef;
   int minX = std::min(x, s.width_ - 1 - x);
@@ -486,8 +2064,6 @@ std::pair<double, CellState> Solver::Config::GuessScore(const Solver &s, int x,
     score += edgeScore[minY];
   }
 
-  std::vector<double> pattern = s.GridAt(x, y);
-  std::vector<double> pattern_score = n->evaluate(pattern);
   CellState val = CellState::SOLID;
   if (pattern_score[0] > pattern_score[1]) {
     score += pattern_score[0];
@@ -503,80 +2079,259 @@ std::pair<double, CellState> Solver::Config::GuessScore(const Solver &s, int x,
 // picks an unwritten cell and make a guess. Returs object like
 // {x,y,val}. Returns empty guess if everything has been filled.
 Solver::Guess Solver::guess() {
-  auto r = Solver::Guess::Empty();
+  if (numOpen_ == 0) {
+    return Solver::Guess::Empty();
+  }
+  topGuesses(1);
+  if (guesses_.empty()) {
+    return Solver::Guess::Empty();
+  }
+  return guesses_.front();
+}
 
-  double maxScore = -std::numeric_limits<double>::infinity();
+// collects up to n unwritten cells with the highest scores into
+// guesses_, best first. Among equal scores the first one in scan order
+// (x major) wins.
+void Solver::topGuesses(int n) {
+  updateCandidates();
+  guesses_.clear();
+  // valid entries are popped into the tail of candidates_, past the
+  // heap, and pushed back afterwards.
+  size_t end = candidates_.size();
+  while (static_cast<int>(guesses_.size()) < n && end > 0) {
+    std::pop_heap(candidates_.begin(), candidates_.begin() + end);
+    end--;
+    const Candidate &k = candidates_[end];
+    if (outdated(k)) {
+      candidates_.erase(candidates_.begin() + end);
+      continue;
+    }
+    guesses_.push_back(
+        Guess{.x = k.order / height_,
+              .y = k.order % height_,
+              .val = k.crossed ? CellState::CROSSED : CellState::SOLID});
+  }
+  while (end < candidates_.size()) {
+    end++;
+    std::push_heap(candidates_.begin(), candidates_.begin() + end);
+  }
+}
 
-  for (int x = 0; x < width_; x++) {
-    for (int y = 0; y < height_; y++) {
-      if (get(x, y) != CellState::EMPTY) {
-        continue;
+// sets cell g to val on a temporary choice point and propagates, then
+// undoes it. Returns whether val is consistent. If it is, the cells it
+// implied are collected in implied_, or with intersect, only the cells
+// already in implied_ that it implies the same way are kept.
+bool Solver::probeValue(const Guess &g, CellState val, bool intersect) {
+  // probes are always undone with the trail.
+  states_.push_back(State{trail_.size(), guessed_, true, -1, literals_.size()});
+  trailing_ = true;
+  set(g.x, g.y, val);
+  bool ok = infer() && !failed_;
+  if (ok && intersect) {
+    auto differs = [this](const std::pair<int, CellState> &c) {
+      return get(c.first % width_, c.first / width_) != c.second;
+    };
+    implied_.erase(std::remove_if(implied_.begin(), implied_.end(), differs),
+                   implied_.end());
+  } else if (ok) {
+    implied_.clear();
+    for (size_t i = states_.back().trailMark + 1; i < trail_.size(); i++) {
+      if (trail_[i].line < 0) {
+        int c = trail_[i].index;
+        implied_.emplace_back(c, get(c % width_, c / width_));
       }
+    }
+  }
+  failed_ = false;
+  popState();
+  return ok;
+}
 
-      CellState val;
-      double score;
-      std::tie(score, val) = config_.GuessScore(*this, x, y);
+// Failed-literal probing on the top guess candidates: each value of a
+// cell is propagated without search. A value that fails fixes the cell
+// to the other one, and cells implied the same way by both values are
+// fixed as well. Stops at the first cell that fixes anything, so that
+// the caller can propagate it. Returns false if a cell has no
+// consistent value at all.
+bool Solver::probe() {
+  topGuesses(config_.probeCandidates);
+  for (const Guess &g : guesses_) {
+    stats_.probes++;
+    bool solid = probeValue(g, CellState::SOLID, false);
+    bool crossed = probeValue(g, CellState::CROSSED, solid);
 
-      if (score > maxScore) {
-        r.x = x;
-        r.y = y;
-        r.val = val;
-        maxScore = score;
-      }
+    if (!solid && !crossed) {
+      return false;
+    }
+    if (!solid || !crossed) {
+      decide(g.x, g.y, solid ? CellState::SOLID : CellState::CROSSED);
+      stats_.probeFixed++;
+      return true;
+    }
+    for (auto &c : implied_) {
+      decide(c.first % width_, c.first / width_, c.second);
+    }
+    stats_.probeFixed += implied_.size();
+    if (!implied_.empty()) {
+      return true;
     }
   }
-  return r;
+  return true;
 }
 
-// Returns a vector representing the grid around point x,y.
-std::vector<double> Solver::GridAt(int x, int y) const {
-  std::vector<double> g;
-  g.reserve(gridSize);
+void Solver::GridAt(int x, int y, double *g) const {
   for (int i = x - gridHalfEdge; i <= x + gridHalfEdge; i++) {
     for (int j = y - gridHalfEdge; j <= y + gridHalfEdge; j++) {
-      if (i < 0 || i >= width_ || j < 0 || j >= height_) {
-        g.push_back(-1);
-        continue;
-      }
-      switch (get(i, j)) {
-        case CellState::SOLID:
-          g.push_back(1);
-          break;
-        case CellState::EMPTY:
-          g.push_back(0);
-          break;
-        case CellState::CROSSED:
-          g.push_back(-1);
-          break;
-      }
+      *g++ = g_.value(i, j);
     }
   }
-  return g;
 };
 
-bool Solver::solve() {
+bool Solver::search() {
   while (true) {
+    if (stopped()) {
+      return false;
+    }
     if (!infer() || failed_) {
       if (states_.size() == 0) {
         return false;
       }
       failed_ = false;
       popState();
-      set(guessed_.x, guessed_.y,
-          guessed_.val == CellState::SOLID ? CellState::CROSSED
-                                           : CellState::SOLID);
+      decide(guessed_.x, guessed_.y,
+             guessed_.val == CellState::SOLID ? CellState::CROSSED
+                                              : CellState::SOLID);
       stats_.wrongGuesses++;
       guessed_ = Solver::Guess::Empty();
     } else {
+      if (config_.probeCandidates > 0) {
+        int fixed = stats_.probeFixed;
+        if (!probe()) {
+          failed_ = true;
+          continue;
+        }
+        if (stats_.probeFixed != fixed) {
+          continue;
+        }
+      }
       auto g = guess();
       if (g.isEmpty()) {
+        stats_.peakStateBytes = std::max(stats_.peakStateBytes, stateBytes());
         return true;
       }
       guessed_ = g;
+      if (search_ != nullptr && shareBranch(g)) {
+        decide(g.x, g.y, g.val);
+        continue;
+      }
       pushState();
-      set(g.x, g.y, g.val);
+      decide(g.x, g.y, g.val);
+    }
+  }
+}
+
+bool Solver::stopped() {
+  if ((cancel_ != nullptr && *cancel_) ||
+      (search_ != nullptr && search_->done)) {
+    return true;
+  }
+  if (config_.maxStateBytes > 0 &&
+      stats_.peakStateBytes > config_.maxStateBytes) {
+    outOfMemory_ = true;
+    return true;
+  }
+  // reading the clock costs about as much as a short line, so only
+  // look at it every few calls.
+  if (config_.timeoutMs > 0 && !timedOut_ && ++clockChecks_ % 16 == 0 &&
+      std::chrono::steady_clock::now() >= deadline_) {
+    timedOut_ = true;
+  }
+  return timedOut_;
+}
+
+// Hands the other value of guess g to the parallel search if there is
+// a worker, or room to start one, to pick it up.
+bool Solver::shareBranch(const Guess &g) {
+  Search &s = *search_;
+  if (s.idle <= s.queued && !s.startWorker()) {
+    return false;
+  }
+  auto branch = clone();
+  branch->set(g.x, g.y,
+              g.val == CellState::SOLID ? CellState::CROSSED
+                                        : CellState::SOLID);
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.open.push_back(std::move(branch));
+    s.queued++;
+  }
+  s.changed.notify_one();
+  return true;
+}
+
+// Replaces the state of this solver with that of other, a solver of
+// the same puzzle that has found the solution, leaving no choice
+// points to undo.
+void Solver::takeOver(const Solver &other) {
+  g_.assign(other.g_);
+  std::copy(other.arena_.bounds.begin(), other.arena_.bounds.end(),
+            arena_.bounds.begin());
+  for (size_t i = 0; i < lines_.size(); i++) {
+    lines_[i].stats = other.lines_[i].stats;
+  }
+  numSet_ = other.numSet_;
+  failed_ = false;
+  guessed_ = Guess::Empty();
+  dirty_.clear();
+  states_.clear();
+  trail_.clear();
+  literals_.clear();
+  numSnapshots_ = 0;
+  trailing_ = false;
+  resetCells();
+}
+
+bool Solver::solveParallel() {
+  Search s(config_);
+  s.busy = 1;
+  search_ = &s;
+
+  bool solved = search();
+  {
+    std::lock_guard<std::mutex> g(s.mutex);
+    s.busy--;
+    if (solved) {
+      s.done = true;
     }
+    s.changed.notify_all();
+  }
+  if (!solved) {
+    s.work();
+  }
+  for (auto &t : s.threads) {
+    t.join();
+  }
+  search_ = nullptr;
+
+  if (!solved && s.solution) {
+    takeOver(*s.solution);
+    solved = true;
+  }
+  timedOut_ = !solved && (timedOut_ || s.timedOut);
+  outOfMemory_ = !solved && (outOfMemory_ || s.outOfMemory);
+  stats_.add(s.stats);
+  return solved;
+}
+
+bool Solver::solve() {
+  if (config_.timeoutMs > 0) {
+    deadline_ = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(config_.timeoutMs);
+  }
+  if (config_.threads > 1) {
+    return solveParallel();
   }
+  return search();
 }
 
 void Solver::printGrid() {
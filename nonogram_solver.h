@@ -1,9 +1,22 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <vector>
+#include "bit_scan.h"
+#include "line_cache.h"
 #include "neuronet.hpp"
+#include "task_queue.h"
 
 enum class CellState { EMPTY, SOLID, CROSSED };
 
+// Engine used by Line::infer. HEURISTIC runs fitLeftMost with the
+// segment and strip rules, EXACT finds every forced cell with dynamic
+// programming, and HYBRID runs the heuristics until they stop setting
+// cells and then EXACT on a line that is still open, so it sets the
+// same cells as EXACT.
+enum class LineSolver { HEURISTIC, EXACT, HYBRID };
+
 enum class Direction { EMPTY, ROW, COLUMN };
 struct LineName {
   Direction dir = Direction::EMPTY;
@@ -42,24 +55,172 @@ struct LineStats {
   int numChanges;    // number of changes since last examination
 };
 
+constexpr int edgeScoreLen = 5;  // special treatment of edge
+constexpr int gridHalfEdge = 2;  // neuronet grid size (5x5)
+constexpr int gridEdge = 2 * gridHalfEdge + 1;
+constexpr int gridSize = gridEdge * gridEdge;
+
+constexpr int wordBits = 64;
+// lines with more words than this per plane keep a summary in BitGrid,
+// which scans of at least this many words look up.
+constexpr int longLineWords = 8;
+// lines of up to this many words of cells are fit with word operations,
+// see Line::fitWords.
+constexpr int maxFitWords = 4;
+// the longest line and the largest clue that fit the uint16_t bounds and
+// clues of Solver::LineArena; a line's changed range reaches length + 2.
+constexpr int maxLineLength = 65533;
+constexpr int maxClue = 65535;
+
+// BitGrid stores cell states as two bit-planes, solid and crossed,
+// with one bit per cell. Each row keeps its solid words followed by
+// its crossed words, so a whole row is contiguous. A transposed copy
+// is kept in sync on every write so that columns are contiguous, too.
+//
+// The grid is surrounded by a border of gridHalfEdge CROSSED cells, so
+// get() works for the whole 5x5 pattern of any cell, and scans along
+// a line stop at the border. Cell x of a row is bit x + gridHalfEdge.
+//
+// Long lines also keep a summary of their words, in three planes: bit
+// k of the first one is set when word k of the line holds a SOLID cell,
+// of the second one a CROSSED cell and of the third one an EMPTY cell.
+// Scans use it to skip to the next word of interest in one step.
+class BitGrid {
+  int width_;
+  int height_;
+  int rowWords_;  // words per plane of a row
+  int colWords_;  // words per plane of a column
+  std::vector<uint64_t> rows_;
+  std::vector<uint64_t> cols_;
+  int rowSummaryWords_;  // words per summary plane of a row, or 0
+  int colSummaryWords_;
+  std::vector<uint64_t> rowSummary_;
+  std::vector<uint64_t> colSummary_;
+
+  // index of the solid word of cell x of row y in rows_; the same
+  // for cell y of column x in cols_ with the arguments swapped.
+  size_t rowWord(int x, int y) const {
+    return 2 * (y + gridHalfEdge) * rowWords_ + (x + gridHalfEdge) / wordBits;
+  };
+  size_t colWord(int x, int y) const {
+    return 2 * (x + gridHalfEdge) * colWords_ + (y + gridHalfEdge) / wordBits;
+  };
+  static uint64_t bit(int i) {
+    return uint64_t(1) << ((i + gridHalfEdge) % wordBits);
+  };
+  // updates the bits of word k of a line, whose planes start at w, in
+  // its summary.
+  static void summarize(uint64_t *summary, int summaryWords,
+                        const uint64_t *w, int words, int k);
+  // words per summary plane of a line of words words, or 0.
+  static int summaryWords(int words) {
+    return words > longLineWords ? (words + wordBits - 1) / wordBits : 0;
+  };
+
+ public:
+  BitGrid(int width, int height);
+  // resizes the grid, with every cell EMPTY again.
+  void reset(int width, int height);
+
+  // x and y may be up to gridHalfEdge outside the grid.
+  CellState get(int x, int y) const {
+    const uint64_t *w = &rows_[rowWord(x, y)];
+    if (w[0] & bit(x)) return CellState::SOLID;
+    if (w[rowWords_] & bit(x)) return CellState::CROSSED;
+    return CellState::EMPTY;
+  };
+  // 1 for SOLID, -1 for CROSSED and 0 for EMPTY, without branches.
+  int value(int x, int y) const {
+    const uint64_t *w = &rows_[rowWord(x, y)];
+    int p = (x + gridHalfEdge) % wordBits;
+    return int(w[0] >> p & 1) - int(w[rowWords_] >> p & 1);
+  };
+  // set cell x,y from EMPTY to s.
+  void set(int x, int y, CellState s);
+  // set cell x,y back to EMPTY.
+  void clear(int x, int y);
+
+  // Copy all cells from o. When o has the same dimensions, the storage
+  // is reused so that pointers from solid()/crossed() stay valid.
+  void assign(const BitGrid &o);
+  // memory held by the planes.
+  size_t bytes() const {
+    return (rows_.size() + cols_.size() + rowSummary_.size() +
+            colSummary_.size()) *
+           sizeof(uint64_t);
+  };
+
+  // Planes of a line. Bit i + gridHalfEdge is cell i of the line.
+  const uint64_t *solid(LineName name) const;
+  const uint64_t *crossed(LineName name) const;
+  // the summary planes of a line, or null for a line too short for one.
+  const uint64_t *summary(LineName name) const;
+};
+
 class Solver;
 
-class Slice {
+// A view of one line of the grid. With Reversed, slice index 0 is the
+// last cell of the line; the direction is a template parameter so that
+// the index math of the scans folds away.
+template <bool Reversed>
+class BasicSlice {
   Solver &solver_;
-  const std::vector<CellState> &g_;
-  int offset0_;
-  int step_;
+  LineName name_;
+  const uint64_t *solid_;
+  const uint64_t *crossed_;
+  const uint64_t *summary_;  // may be null, see BitGrid
   int length_;
 
- public:
-  Slice(Solver &solver, int offset0, int step, int length);
-  Slice(Solver &solver, LineName name);
+  // bit position of slice index i in the planes, and back.
+  int pos(int i) const {
+    return (Reversed ? length_ - 1 - i : i) + gridHalfEdge;
+  };
+  int index(int p) const {
+    p -= gridHalfEdge;
+    return Reversed ? length_ - 1 - p : p;
+  };
+
+  // returns the first slice index in [start, end) where Op has a set
+  // bit, or end if there is none.
+  template <ScanOp Op>
+  int scan(int start, int end) const;
+  // the same as scan(start, length_) for an Op that is set on the
+  // CROSSED border, which ends the scan without bounds checks.
+  template <ScanOp Op>
+  int scanToBorder(int start) const;
+  // bit k % wordBits is set when Op is set in word k, for the words k
+  // of summary word j.
+  template <ScanOp Op>
+  uint64_t summaryWord(int j) const;
+  // the words where Op is next set after the first one of a scan, in
+  // [from, to) forward and (to, from] backward, or to if there is none.
+  template <ScanOp Op>
+  int nextWord(int from, int to) const;
+  template <ScanOp Op>
+  int prevWord(int from, int to) const;
 
-  CellState get(int i) const { return g_[offset0_ + step_ * i]; };
+ public:
+  BasicSlice(Solver &solver, LineName name);
+
+  // i may be up to gridHalfEdge outside the slice, which is CROSSED.
+  CellState get(int i) const {
+    int p = pos(i);
+    uint64_t bit = uint64_t(1) << (p % wordBits);
+    if (solid_[p / wordBits] & bit) return CellState::SOLID;
+    if (crossed_[p / wordBits] & bit) return CellState::CROSSED;
+    return CellState::EMPTY;
+  };
   void set(int i, CellState s) const;
 
   int length() const { return length_; };
 
+  // bit-planes of the line in its forward order, with the border.
+  int words() const {
+    return (length_ + 2 * gridHalfEdge + wordBits - 1) / wordBits;
+  };
+  const uint64_t *solidWords() const { return solid_; };
+  const uint64_t *crossedWords() const { return crossed_; };
+
   // returns the first position >= start where a hole (no X) of size
   // length is found. If no such hole is found, return -1.
   int findHoleStartingAt(int start, int length) const;
@@ -69,63 +230,149 @@ class Slice {
   int stripLength(int i) const;
 
   int indexOfNextSolid(int start, int bound) const;
+  int indexOfNextEmpty(int start) const;
 
   // setSegment between i and j (exclusive) to state val.
   int setSegment(int i, int j, CellState val) const;
 
-  Slice reverse() const;
+  BasicSlice<!Reversed> reverse() const;
 };
 
+using Slice = BasicSlice<false>;
+using ReversedSlice = BasicSlice<true>;
+
+// A view of the clues and bounds of one line, which live in the
+// solver's LineArena.
 class Line {
  private:
-  const std::vector<int> len_;
-  std::vector<int> lb_;
-  std::vector<int> ub_;
-  std::vector<bool> done_;
+  Solver &solver_;
+  int n_;                    // number of segments
+  const uint16_t *len_;      // clues, followed by them reversed
+  const uint16_t *minLen_;   // sparse tables of the clues, see LineArena
+  const uint16_t *maxLen_;
+  uint16_t *lb_;             // first of the undo slots, see undo()
+  uint16_t *ub_;
+  uint16_t *done_;
+  // cells changed since the bounds were last fit, [changed_[0],
+  // changed_[1]). A range past the end of the line means the bounds
+  // are not a fit at all, as at the start.
+  uint16_t *changed_;
   const Slice slice_;
-
-  int numSegments() { return len_.size(); };
-  int len(int i) { return len_[i]; };
-  int lb(int i) { return lb_[i]; };
-  int ub(int i) { return slice_.length() - ub_[ub_.size() - 1 - i] - 1; };
-  bool done(int i) { return done_[i]; };
-
-  static bool fitLeftMost(Slice slice, const std::vector<int> &len,
-                          std::vector<int> &lb);
+  // words of cells for fitWords and inferSegmentsWords: 1, 2 or
+  // maxFitWords, or 0 for a line that is fit one cell at a time.
+  int words_;
+
+  int numSegments() const { return n_; };
+  int len(int i) const { return len_[i]; };
+  int lb(int i) const { return lb_[i]; };
+  int ub(int i) const { return slice_.length() - ub_[n_ - 1 - i] - 1; };
+  bool done(int i) const { return done_[i]; };
+
+  // Refits lb, the left-most fit of the line before cells [from, to)
+  // changed, around those cells.
+  template <typename S>
+  static bool fitLeftMost(const S &slice, const uint16_t *len, int n,
+                          int *lb, int from, int to);
+  // updates lb_ and ub_ from the left-most fits of the line forward and
+  // backward, starting at the segments that the changed cells woke. The
+  // segments whose bounds moved are [woken->first, woken->second), and
+  // [cells->first, cells->second) holds the changed cells and the old
+  // windows of those segments, or is empty.
+  template <typename S, typename R>
+  bool fitBounds(const S &forward, const R &backward,
+                 std::pair<int, int> *woken, std::pair<int, int> *cells);
+  // The left-most fits of the line forward into left and backward into
+  // right, for a line of up to W words of cells. Both come from the
+  // sets of starts of each segment that leave room for the segments
+  // before it, which word shifts and additions find for all cells at
+  // once; they are the same fits as those of fitLeftMost.
+  template <int W>
+  bool fitWords(int *left, int *right);
+  // inferSegments on masks of the cells to set.
+  template <int W>
+  bool inferSegmentsWords(int first, int last);
+
+  // Copy the solver's fit scratch into bounds (lb_ or ub_, whose undo
+  // slots start at slot0), trailing the entries that changed. Returns
+  // the range of entries that changed, empty when first >= second, and
+  // stores the old value of entry first in old if it is not null.
+  std::pair<int, int> commitBounds(uint16_t *bounds, int slot0,
+                                   int *old = nullptr);
+  // records that bounds moved outside of fitBounds, so that the next
+  // strip pass looks at the windows they had.
+  void boundsMoved(int oldFirst, int oldLast);
+  void setDone(int i);
 
   // returns a segment index ranges (left inclusive, right exclusive)
   // that lb(i) <= start and ub(i) >= end.
   std::pair<int, int> collidingSegments(int start, int end);
+  // the shortest and the longest clue of segments [first, last), which
+  // must not be empty.
+  int shortest(int first, int last) const;
+  int longest(int first, int last) const;
 
  public:
-  Line(Solver &solver, LineName name, std::vector<int> &&len);
+  // the clues of name must already be in the solver's arena.
+  Line(Solver &solver, LineName name);
+  // copies other, a line of another solver, into solver, whose arena
+  // must hold a copy of the other one.
+  Line(Solver &solver, const Line &other);
   void updateStats();
-  bool inferSegments();
-  bool inferStrips();
+  // sets the cells implied by the bounds of segments [first, last) and
+  // the gaps after them; the other segments did not move since they
+  // were last applied.
+  bool inferSegments(int first, int last);
+  // looks at the strips near cells [from, to) and near the cells
+  // changed since the bounds were fit; see inferHeuristic.
+  bool inferStrips(int from, int to);
+  // refits the bounds to the cells, as inferHeuristic does first,
+  // without setting any cells.
+  bool fit();
+  bool inferHeuristic();
+  bool inferExact();
+  bool inferEngine();
+  bool inferCached(LineCache &cache);
   bool infer();
+  // checks a line without EMPTY cells against its segments.
+  bool verify() const;
+  // records that cell i of the line changed.
+  void changed(int i);
 
   LineName name;
   LineStats stats;
 
-  struct State {
-    std::vector<int> lb;
-    std::vector<int> ub;
-    std::vector<bool> done;
-
-    explicit State(const Line &l);
-    State() = default;
-    State(const State &) = default;
-    State(State &&) = default;
-    State &operator=(const State &) = default;
-    State &operator=(State &&) = default;
-  };
-  State getState() const;
-  void setState(State &&s);
+  // Restore a value recorded on the solver trail. Slots [0, n) are
+  // lb_, [n, 2n) are ub_, [2n, 3n) are done_ and [3n, 3n + 2) are
+  // changed_.
+  void undo(int slot, int old) { lb_[slot] = old; };
 };
 
-constexpr int edgeScoreLen = 5;  // special treatment of edge
-constexpr int gridHalfEdge = 2;  // neuronet grid size (5x5)
-constexpr int gridSize = (2 * gridHalfEdge + 1) * (2 * gridHalfEdge + 1);
+// DirtyQueue is an indexed binary max-heap of line indices keyed by
+// their score. pos_ records where each line sits in heap_ (-1 when the
+// line is not queued), so membership is O(1) and no searching or
+// sorting is needed.
+class DirtyQueue {
+  std::vector<int> heap_;
+  std::vector<double> key_;
+  std::vector<int> pos_;
+
+  void swap(int i, int j);
+  void siftUp(int i);
+  void siftDown(int i);
+
+ public:
+  explicit DirtyQueue(int numLines);
+  // empties the queue and resizes it for numLines lines.
+  void reset(int numLines);
+
+  bool empty() const { return heap_.empty(); };
+  bool contains(int line) const { return pos_[line] >= 0; };
+
+  void push(int line, double key);
+  // removes and returns the line with the highest key.
+  int pop();
+  void clear();
+};
 
 class Solver {
  public:
@@ -147,17 +394,86 @@ class Solver {
     double edgeScore[edgeScoreLen];
     std::unique_ptr<Net> n;
 
-    std::pair<double, CellState> GuessScore(const Solver &s, int x,
-                                            int y) const;
+    // patternScore is the output of n for GridAt(x, y).
+    std::pair<double, CellState> GuessScore(const Solver &s, int x, int y,
+                                            const double *patternScore) const;
     int maxLines;  // number of lines to check before failing
+    int timeoutMs = 0;  // wall-clock limit of solve(); 0 for none
+    LineSolver lineSolver = LineSolver::HEURISTIC;
+    // line inference cache shared by all solvers; may be null.
+    std::unique_ptr<LineCache> cache;
+    // number of top guess candidates to probe before each guess.
+    int probeCandidates = 0;
+    // refit only the segments of a line around its changed cells, and
+    // apply only the segments that moved; false does whole lines.
+    bool incrementalFit = true;
+    // fit lines of up to maxFitWords words of cells with word
+    // operations; false fits every line one cell at a time.
+    bool wordFit = true;
+    // threads used to search one puzzle, and the process-wide budget
+    // they are taken from (may be null).
+    int threads = 1;
+    ThreadBudget *budget = nullptr;
+    // With recomputeEvery = k > 0, choice points keep no undo trail:
+    // every k-th one stores a copy of the grid and the line bounds,
+    // and backtracking restores the nearest copy and replays the cells
+    // decided since. 0 trails every choice point.
+    int recomputeEvery = 0;
+    // give up once Stats::peakStateBytes exceeds this; 0 for no limit.
+    long maxStateBytes = 0;
   };
   const Config &config_;
 
-  const int width_;
-  const int height_;
-  std::vector<CellState> g_;
+  int width_;
+  int height_;
+  BitGrid g_;
   LineName lineName_;  // the line we are working on
   bool failed_ = false;
+  long numSet_ = 0;  // number of cells set, to detect progress
+  // number of cells set against their state, to tell a line's own
+  // contradictions from those of the full lines its cells verify.
+  long numConflicts_ = 0;
+
+  // scratch space for Line::inferExact, shared by all lines.
+  struct ExactScratch {
+    std::vector<CellState> cells;
+    std::vector<int> crossed;  // prefix count of crossed cells
+    std::vector<int> cover;    // difference array of possible solids
+    std::vector<bool> reach;   // forward and backward reachability
+    std::vector<bool> canCross;
+    std::vector<int> last;  // last feasible start of each segment
+  } exact_;
+
+  // Clues and bounds of all lines in flat arrays. The segments of line
+  // i are [first[i], first[i + 1]). Its clues sit at twice that range,
+  // forward and then reversed for the backward fit, and its undo slots
+  // (see Line::undo) at 3 * first[i] + 2 * i, so the bounds of the
+  // whole puzzle are a single array.
+  //
+  // The sparse tables of the n clues of line i start at
+  // lenTables[tableFirst[i]]: the shortest of clues [k, k + 2^j) at
+  // j * n + k, for each j up to log2(n), and then the longest ones laid
+  // out the same way.
+  struct LineArena {
+    std::vector<uint32_t> first;
+    std::vector<uint16_t> clues;
+    std::vector<uint16_t> bounds;
+    std::vector<uint32_t> tableFirst;
+    std::vector<uint16_t> lenTables;
+  } arena_;
+  // scratch bounds for Line::fitLeftMost and Line::inferExact.
+  std::vector<int> fit_;
+  // scratch space for Line::fitWords: the starts of each segment that
+  // leave room for the segments before it, maxFitWords words per
+  // segment, and the backward fit.
+  struct WordScratch {
+    std::vector<uint64_t> starts;
+    std::vector<int> right;
+  } words_;
+
+  // scratch space for Line::inferCached.
+  LineCache::Key cacheKey_;
+  LineCache::Result cacheResult_;
 
   struct Guess {
     int x;
@@ -171,42 +487,222 @@ class Solver {
     bool isEmpty() { return x == -1 && y == -1 && val == CellState::EMPTY; };
   } guessed_ = Guess::Empty();
 
+  // A choice point. Everything changed after it was pushed is on
+  // trail_ past trailMark.
   struct State {
-    std::vector<CellState> g;
-    std::vector<Line::State> lines;
+    size_t trailMark;
     Guess guessed;
+    // Without a trail, the state is rebuilt from its snapshot, or the
+    // nearest one below, and the literals_ before literalMark.
+    bool trailed;
+    int snapshot;  // index in snapshots_, or -1
+    size_t literalMark;
+  };
+
+  // An entry of the undo log: either a cell that was set (line == -1,
+  // index == x + y * width_), or a value of line `line` that was
+  // overwritten (see Line::undo).
+  struct TrailEntry {
+    int line;
+    int index;
+    int old;
   };
 
   struct Stats {
     int lineCount = 0;
     int wrongGuesses = 0;
     int maxDepth = 0;
+    int cacheLookups = 0;
+    int cacheHits = 0;
+    int probes = 0;      // cells probed
+    int probeFixed = 0;  // cells fixed by probing
+    long peakStateBytes = 0;  // trail, choice points and snapshots
+
+    // adds the counts of another solver working on the same puzzle.
+    void add(const Stats &o);
   } stats_;
 
+  // when set to true, solve() gives up and returns false; may be null.
+  const std::atomic<bool> *cancel_ = nullptr;
+  // solve() gave up because config_.timeoutMs ran out.
+  bool timedOut_ = false;
+  // solve() gave up because Stats::peakStateBytes went over
+  // config_.maxStateBytes.
+  bool outOfMemory_ = false;
+
  private:
-  std::vector<std::unique_ptr<Line>> lines_;
-  std::vector<LineName> dirty_;
+  std::vector<Line> lines_;
+  DirtyQueue dirty_;
   std::vector<State> states_;
+  std::vector<TrailEntry> trail_;
+
+  // scratch space for guess() and probe().
+  std::vector<Guess> guesses_;
+  std::vector<int> batchCells_;  // x + y * width_ of each pattern
+  std::vector<double> patterns_;
+  std::vector<double> patternScores_;
+  std::vector<double> netScratch_;
+
+  // Guess scores are kept in a lazy max-heap. A cell is rescored when a
+  // cell of its 5x5 pattern changes or when the LineScore of its row or
+  // column changes. Heap entries whose stamp is older than the cell's
+  // are dropped when they reach the top, or all at once when they make
+  // up most of the heap.
+  struct Candidate {
+    double score;
+    int order;  // scan order x * height_ + y, to break ties
+    unsigned stamp : 31;
+    unsigned crossed : 1;  // the guess is CROSSED rather than SOLID
+
+    bool operator<(const Candidate &o) const {
+      return score < o.score || (score == o.score && order > o.order);
+    }
+  };
+  std::vector<Candidate> candidates_;  // heap
+  std::vector<unsigned> stamp_;        // below 2^31, as Candidate::stamp
+  std::vector<uint8_t> stale_;
+  std::vector<int> staleCells_;      // cells with stale_ set
+  std::vector<double> lineScores_;   // LineScore of each line when keyed
+
+  int cellOf(const Candidate &k) const {
+    return k.order / height_ + k.order % height_ * width_;
+  };
+  bool outdated(const Candidate &k) const;
+  void resetCandidates();
+  void markStale(int cell);
+  void updateCandidates();
+
+  // The first layer of config_.n kept up to date for every cell, NNUE
+  // style, so that guessing only runs the remaining layers. acc_ holds
+  // the weighted sums of each cell's GridAt pattern in fixed point;
+  // integer sums make undoing a cell exact. The scale is a power of two
+  // that keeps every sum within 31 bits. acc_ and the guess cache are
+  // built by the first guess, so a puzzle that line inference solves
+  // alone never pays for them.
+  int accDim_;                       // units of the first layer
+  double accScale_;                  // fixed point scale of acc_
+  std::vector<int32_t> accWeights_;  // [pattern index][unit]
+  std::vector<int32_t> acc_;         // [x + y * width_][unit]
+  bool scoring_ = false;             // acc_ and the guess cache are kept
+  // builds acc_ from g_ and marks every guess score stale.
+  void resetScores();
+  // adds sign times the value of cell x,y to its neighbors' sums, and
+  // marks their guess scores stale.
+  void accumulate(int x, int y, int sign);
+  std::vector<std::pair<int, CellState>> implied_;
+
+  void topGuesses(int n);
+  bool probeValue(const Guess &g, CellState val, bool intersect);
+
+  // Unresolved cells as a sparse set: open_[0, numOpen_) are the EMPTY
+  // cells and openPos_ is the position of each cell in open_. A set
+  // cell is swapped to the end of the range and dropped, so undoing
+  // sets in reverse order only has to grow numOpen_ again.
+  std::vector<int> open_;
+  std::vector<int> openPos_;
+  int numOpen_;
+  std::vector<int> emptyCount_;  // EMPTY cells of each line
+
+  // parallel search over one puzzle; see nonogram_solver.cpp.
+  struct Search;
+  Search *search_ = nullptr;
+  // lines examined by the solvers this one was cloned from, up to the
+  // clone.
+  int lineage_ = 0;
+
+  // Recomputation, see Config::recomputeEvery. A snapshot is the
+  // state that resetCells() cannot derive from the grid; line stats
+  // are left as they are, as when undoing the trail.
+  struct Snapshot {
+    BitGrid grid;
+    std::vector<uint16_t> bounds;
+  };
+  std::vector<Snapshot> snapshots_;  // [0, numSnapshots_) are in use
+  int numSnapshots_ = 0;
+  // cells set by decide() under choice points without a trail.
+  std::vector<Guess> literals_;
+  bool trailing_ = false;  // whether changes go on trail_
+
+  int takeSnapshot();
+  // rebuilds the state of the top choice point, which has no trail.
+  void recompute();
+  // derives the unresolved cells from g_, and acc_ and the guess cache
+  // if they are kept.
+  void resetCells();
+  long stateBytes() const;
+  // sets a cell outside of line inference, e.g. a guess.
+  void decide(int x, int y, CellState val);
+
+  bool shareBranch(const Guess &g);
+  bool solveParallel();
+  void takeOver(const Solver &other);
+
+  // copies the state of other for clone().
+  struct Fork {};
+  Solver(const Solver &other, Fork);
+
+  std::chrono::steady_clock::time_point deadline_;
+  int clockChecks_ = 0;
+
+  // whether the search should give up: cancelled from outside, past
+  // the deadline, or another solver of a parallel search found the
+  // solution.
+  bool stopped();
 
  public:
   Solver(const Config &config, std::vector<std::vector<int>> &&rows,
          std::vector<std::vector<int>> &&cols);
-
-  CellState get(int x, int y) const { return g_[x + y * width_]; };
+  // a solver copies only with clone().
+  Solver(const Solver &) = delete;
+  Solver &operator=(const Solver &) = delete;
+  // whether a puzzle has no line longer than maxLineLength and no clue
+  // outside [0, maxClue]. The constructor and reset() take only these.
+  static bool validPuzzle(const std::vector<std::vector<int>> &rows,
+                          const std::vector<std::vector<int>> &cols);
+  // starts over on another puzzle, reusing the memory of this one.
+  void reset(const std::vector<std::vector<int>> &rows,
+             const std::vector<std::vector<int>> &cols);
+
+  CellState get(int x, int y) const { return g_.get(x, y); };
   void set(int x, int y, CellState s);
-  Line &getLine(LineName name) const {
-    int i = name.dir == Direction::ROW ? name.index : name.index + height_;
-    return *(lines_[i].get());
+  int lineIndex(LineName name) const {
+    return name.dir == Direction::ROW ? name.index : name.index + height_;
+  };
+  LineName lineName(int i) const {
+    return i < height_ ? LineName::Row(i) : LineName::Column(i - height_);
+  };
+  Line &getLine(LineName name) { return lines_[lineIndex(name)]; };
+  const Line &getLine(LineName name) const {
+    return lines_[lineIndex(name)];
+  };
+  int emptyCells(LineName name) const { return emptyCount_[lineIndex(name)]; };
+  int unresolved() const { return numOpen_; };
+
+  // record an overwritten line value; nothing needs recording before
+  // the first choice point, or under one without a trail.
+  void trail(int line, int slot, int old) {
+    if (trailing_) {
+      trail_.push_back(TrailEntry{line, slot, old});
+    }
   };
 
   LineName getDirty();
-  void markDirty(LineName n);
-  std::vector<double> GridAt(int x, int y) const;
+  // cell index of line n changed.
+  void markDirty(LineName n, int index);
+  // writes the gridSize values of the grid around point x,y to g.
+  void GridAt(int x, int y, double *g) const;
+
+  // a new solver at the current state, to search a subtree from it. It
+  // starts without choice points, dirty lines or stats of its own.
+  std::unique_ptr<Solver> clone() const;
 
   void pushState();
   void popState();
   bool infer();
   Guess guess();
+  bool probe();
+  // depth-first search from the current state.
+  bool search();
   bool solve();
 
   void printGrid();
@@ -0,0 +1,447 @@
+#include "nonogram_solver.h"
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+
+// every heap allocation of the process is counted here.
+static std::atomic<long> allocations{0};
+
+void *operator new(std::size_t n) {
+  allocations++;
+  void *p = std::malloc(n == 0 ? 1 : n);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+// segment lengths of a line of cells.
+std::vector<int> clue(const std::vector<bool> &cells) {
+  std::vector<int> r;
+  int run = 0;
+  for (bool c : cells) {
+    if (c) {
+      run++;
+    } else if (run > 0) {
+      r.push_back(run);
+      run = 0;
+    }
+  }
+  if (run > 0) {
+    r.push_back(run);
+  }
+  return r;
+}
+
+// clues of a random width x height picture, with one in density cells
+// solid.
+void picture(std::mt19937 &rng, int width, int height, int density,
+             std::vector<std::vector<int>> &rows,
+             std::vector<std::vector<int>> &cols) {
+  std::vector<std::vector<bool>> cells(height, std::vector<bool>(width));
+  rows.clear();
+  cols.clear();
+  for (auto &r : cells) {
+    for (int x = 0; x < width; x++) {
+      r[x] = rng() % density == 0;
+    }
+    rows.push_back(clue(r));
+  }
+  for (int x = 0; x < width; x++) {
+    std::vector<bool> c;
+    for (auto &r : cells) {
+      c.push_back(r[x]);
+    }
+    cols.push_back(clue(c));
+  }
+}
+
+// whether the grid of s has the given clues in every row and column.
+bool fitsClues(const Solver &s, const std::vector<std::vector<int>> &rows,
+               const std::vector<std::vector<int>> &cols) {
+  bool ok = true;
+  for (int y = 0; y < int(rows.size()); y++) {
+    std::vector<bool> cells;
+    for (int x = 0; x < int(cols.size()); x++) {
+      cells.push_back(s.get(x, y) == CellState::SOLID);
+    }
+    ok = ok && clue(cells) == rows[y];
+  }
+  for (int x = 0; x < int(cols.size()); x++) {
+    std::vector<bool> cells;
+    for (int y = 0; y < int(rows.size()); y++) {
+      cells.push_back(s.get(x, y) == CellState::SOLID);
+    }
+    ok = ok && clue(cells) == cols[x];
+  }
+  return ok;
+}
+
+// counts the scans of slice that differ from looking at one cell at a
+// time.
+template <typename S>
+int scanMismatches(const S &slice, std::mt19937 &rng) {
+  int n = slice.length();
+  int mismatches = 0;
+  for (int round = 0; round < 50; round++) {
+    int start = rng() % n;
+    int bound = start + rng() % (n - start + 1);
+    int solid = start;
+    while (solid < bound && slice.get(solid) != CellState::SOLID) {
+      solid++;
+    }
+    int empty = start;
+    while (empty < n && slice.get(empty) != CellState::EMPTY) {
+      empty++;
+    }
+    int strip = 1;
+    while (start + strip < n && slice.get(start + strip) == slice.get(start)) {
+      strip++;
+    }
+    int length = 1 + rng() % 40;
+    int hole = start;
+    for (int i = start; i < n && i - hole < length; i++) {
+      if (slice.get(i) == CellState::CROSSED) {
+        hole = i + 1;
+      }
+    }
+    if (n - hole < length) {
+      hole = -1;
+    }
+    mismatches += (slice.indexOfNextSolid(start, bound) !=
+                   (solid < bound ? solid : -1)) +
+                  (slice.indexOfNextEmpty(start) != (empty < n ? empty : -1)) +
+                  (slice.stripLength(start) != strip) +
+                  (slice.findHoleStartingAt(start, length) != hole);
+  }
+  return mismatches;
+}
+
+int main() {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> coef(-1, 1);
+
+  Solver::Config config;
+  config.wiggleRoom = -1;
+  config.numSegments = 0.1;
+  config.doneSegments = 0.2;
+  config.numChanges = 1;
+  config.rowCoef = 1;
+  config.colCoef = 1;
+  for (int i = 0; i < edgeScoreLen; i++) {
+    config.edgeScore[i] = 0.1 * (edgeScoreLen - i);
+  }
+  std::vector<std::vector<double>> coefs = {
+      std::vector<double>(8 * (gridSize + 1)), std::vector<double>(2 * 9)};
+  for (auto &c : coefs) {
+    for (double &v : c) {
+      v = coef(rng);
+    }
+  }
+  config.n = std::make_unique<Net>(coefs, gridSize);
+  config.maxLines = 1000000;
+
+  // a random picture, which takes some guessing to solve.
+  std::vector<std::vector<int>> rows, cols;
+  picture(rng, 30, 25, 2, rows, cols);
+
+  auto r = rows;
+  auto c = cols;
+  Solver s(config, std::move(r), std::move(c));
+  bool solved = s.solve();
+  int wrongGuesses = s.stats_.wrongGuesses;
+
+  // the second solve runs in memory left over from the first.
+  s.reset(rows, cols);
+  long before = allocations;
+  bool again = s.solve();
+  long after = allocations;
+
+  std::cout << solved << ' ' << again << ' ' << (wrongGuesses > 0) << ' '
+            << (s.stats_.wrongGuesses == wrongGuesses) << std::endl;  // 1 1 1 1
+  std::cout << after - before << " allocations" << std::endl;  // 0 allocations
+
+  // a parallel search leaves the solver in the state of the solution,
+  // whichever worker found it.
+  config.threads = 4;
+  int consistent = 0;
+  for (int round = 0; round < 10; round++) {
+    picture(rng, 20, 20, 2, rows, cols);
+    auto rp = rows;
+    auto cp = cols;
+    Solver p(config, std::move(rp), std::move(cp));
+    bool ok = p.solve() && p.unresolved() == 0;
+    for (int y = 0; y < 20; y++) {
+      std::vector<bool> cells;
+      for (int x = 0; x < 20; x++) {
+        cells.push_back(p.get(x, y) == CellState::SOLID);
+      }
+      ok = ok && clue(cells) == rows[y];
+    }
+    int wrong = p.stats_.wrongGuesses;
+    ok = ok && p.solve() && p.stats_.wrongGuesses == wrong;
+    consistent += ok;
+  }
+  config.threads = 1;
+  std::cout << consistent << " of 10 parallel solves" << std::endl;  // 10 of 10 parallel solves
+
+  // choice points rebuilt from snapshots may not reach the same bounds
+  // as those undone from the trail, so the searches may take different
+  // paths, but both find a solution.
+  int alike = 0;
+  for (int round = 0; round < 10; round++) {
+    picture(rng, 20, 20, 2, rows, cols);
+    auto ra = rows;
+    auto ca = cols;
+    Solver a(config, std::move(ra), std::move(ca));
+    bool solvedA = a.solve();
+    config.recomputeEvery = 3;
+    auto rb = rows;
+    auto cb = cols;
+    Solver b(config, std::move(rb), std::move(cb));
+    bool solvedB = b.solve();
+    config.recomputeEvery = 0;
+    alike += solvedA && solvedB && b.unresolved() == 0 &&
+             fitsClues(a, rows, cols) && fitsClues(b, rows, cols);
+  }
+  std::cout << alike << " of 10 recomputed solves" << std::endl;  // 10 of 10 recomputed solves
+
+  // a search over its state budget gives up with a status of its own.
+  config.maxStateBytes = 1;
+  auto rm = rows;
+  auto cm = cols;
+  Solver m(config, std::move(rm), std::move(cm));
+  bool solvedM = m.solve();
+  config.maxStateBytes = 0;
+  std::cout << solvedM << ' ' << m.outOfMemory_ << ' ' << m.timedOut_ << ' '
+            << s.outOfMemory_ << std::endl;  // 0 1 0 0
+
+  // a line that fills up a crossing line against its clue is not a
+  // contradiction of its own, so a shared cache must not keep it as one.
+  config.cache = std::make_unique<LineCache>(1000);
+  Solver u(config, {{3}}, {{}, {1}, {1}});
+  bool unsolvable = u.solve();
+  u.reset({{3}}, {{1}, {1}, {1}});
+  bool solvable = u.solve();
+  std::cout << unsolvable << ' ' << solvable << ' ' << u.stats_.cacheHits
+            << std::endl;  // 0 1 1
+  config.cache = nullptr;
+
+  // the exact engine, and the heuristics followed by it, set every cell
+  // that has the same state in all solutions of a line, and no other.
+  int exactMisses = 0, hybridMisses = 0;
+  for (int round = 0; round < 3000; round++) {
+    int length = 1 + rng() % 14;
+    std::vector<bool> cells(length);
+    std::vector<std::vector<int>> cols;
+    for (int x = 0; x < length; x++) {
+      cells[x] = rng() % 2 == 0;
+      cols.push_back(cells[x] ? std::vector<int>{1} : std::vector<int>());
+    }
+    std::vector<int> line = clue(cells);
+    Solver a(config, {line}, std::vector<std::vector<int>>(cols));
+    Solver b(config, {line}, std::move(cols));
+    for (int x = 0; x < length; x++) {
+      if (rng() % 3 == 0) {
+        CellState val = cells[x] ? CellState::SOLID : CellState::CROSSED;
+        a.set(x, 0, val);
+        b.set(x, 0, val);
+      }
+    }
+    // 1 and 2 for cells solid and crossed in some solution.
+    std::vector<int> seen(length);
+    for (int m = 0; m < 1 << length; m++) {
+      std::vector<bool> c(length);
+      bool fits = true;
+      for (int x = 0; x < length; x++) {
+        c[x] = m >> x & 1;
+        CellState known = a.get(x, 0);
+        fits = fits && (known == CellState::EMPTY ||
+                        (known == CellState::SOLID) == c[x]);
+      }
+      if (fits && clue(c) == line) {
+        for (int x = 0; x < length; x++) {
+          seen[x] |= c[x] ? 1 : 2;
+        }
+      }
+    }
+    a.getLine(LineName::Row(0)).inferExact();
+    config.lineSolver = LineSolver::HYBRID;
+    b.getLine(LineName::Row(0)).inferEngine();
+    config.lineSolver = LineSolver::HEURISTIC;
+    for (int x = 0; x < length; x++) {
+      CellState forced = seen[x] == 1   ? CellState::SOLID
+                         : seen[x] == 2 ? CellState::CROSSED
+                                        : CellState::EMPTY;
+      exactMisses += a.get(x, 0) != forced;
+      hybridMisses += b.get(x, 0) != forced;
+    }
+  }
+  std::cout << exactMisses << ' ' << hybridMisses << " line cells missed"
+            << std::endl;  // 0 0
+
+  // refitting only around changed cells, and applying only the segments
+  // that moved, must set the same cells as refitting and applying whole
+  // lines, so both solve alike, or give up alike.
+  config.maxLines = 20000;
+  config.wordFit = false;
+  int differ = 0;
+  for (int round = 0; round < 200; round++) {
+    int density = 2 + round % 3;
+    picture(rng, 5 + rng() % 20, 5 + rng() % 20, density, rows, cols);
+    config.incrementalFit = true;
+    auto ra = rows;
+    auto ca = cols;
+    Solver a(config, std::move(ra), std::move(ca));
+    bool solvedA = a.solve();
+    config.incrementalFit = false;
+    auto rb = rows;
+    auto cb = cols;
+    Solver b(config, std::move(rb), std::move(cb));
+    bool solvedB = b.solve();
+    config.incrementalFit = true;
+    differ += solvedA != solvedB ||
+              a.stats_.lineCount != b.stats_.lineCount ||
+              a.stats_.wrongGuesses != b.stats_.wrongGuesses;
+  }
+  std::cout << differ << " of 200 solves differ" << std::endl;  // 0 of 200
+
+  // after each change to a line, the bounds refit around the changed
+  // cell are the same as those of a full refit.
+  int boundMismatches = 0;
+  for (int round = 0; round < 300; round++) {
+    int length = 1 + rng() % 600;
+    int density = 2 + round % 3;
+    std::vector<bool> cells(length);
+    std::vector<std::vector<int>> cols;
+    for (int x = 0; x < length; x++) {
+      cells[x] = rng() % density == 0;
+      cols.push_back(cells[x] ? std::vector<int>{1} : std::vector<int>());
+    }
+    Solver a(config, {clue(cells)}, std::vector<std::vector<int>>(cols));
+    Solver b(config, {clue(cells)}, std::move(cols));
+    Line &la = a.getLine(LineName::Row(0));
+    Line &lb = b.getLine(LineName::Row(0));
+    for (int change = 0; change < 100 && a.unresolved() > 0; change++) {
+      int x = rng() % length;
+      while (a.get(x, 0) != CellState::EMPTY) {
+        x = (x + 1) % length;
+      }
+      CellState val = cells[x] ? CellState::SOLID : CellState::CROSSED;
+      a.set(x, 0, val);
+      b.set(x, 0, val);
+      bool fitA = la.fit();
+      config.incrementalFit = false;
+      bool fitB = lb.fit();
+      config.incrementalFit = true;
+      boundMismatches += fitA != fitB || a.arena_.bounds != b.arena_.bounds;
+    }
+  }
+  std::cout << boundMismatches << " bound mismatches" << std::endl;  // 0
+  config.wordFit = true;
+
+  // lines of up to maxFitWords words are fit with word operations,
+  // which find the same bounds as fitting one cell at a time, so both
+  // solve alike.
+  int wordMismatches = 0;
+  config.incrementalFit = false;
+  for (int round = 0; round < 300; round++) {
+    int length = 1 + rng() % (maxFitWords * wordBits);
+    int density = 2 + round % 3;
+    std::vector<bool> cells(length);
+    std::vector<std::vector<int>> cols;
+    for (int x = 0; x < length; x++) {
+      cells[x] = rng() % density == 0;
+      cols.push_back(cells[x] ? std::vector<int>{1} : std::vector<int>());
+    }
+    Solver a(config, {clue(cells)}, std::vector<std::vector<int>>(cols));
+    config.wordFit = false;
+    Solver b(config, {clue(cells)}, std::move(cols));
+    config.wordFit = true;
+    Line &la = a.getLine(LineName::Row(0));
+    Line &lb = b.getLine(LineName::Row(0));
+    for (int change = 0; change < 100 && a.unresolved() > 0; change++) {
+      int x = rng() % length;
+      while (a.get(x, 0) != CellState::EMPTY) {
+        x = (x + 1) % length;
+      }
+      CellState val = cells[x] ? CellState::SOLID : CellState::CROSSED;
+      a.set(x, 0, val);
+      b.set(x, 0, val);
+      wordMismatches +=
+          la.fit() != lb.fit() || a.arena_.bounds != b.arena_.bounds;
+    }
+  }
+  config.incrementalFit = true;
+  for (int round = 0; round < 40; round++) {
+    int density = 2 + round % 3;
+    picture(rng, 5 + rng() % 250, 5 + rng() % 5, density, rows, cols);
+    auto ra = rows;
+    auto ca = cols;
+    Solver a(config, std::move(ra), std::move(ca));
+    bool solvedA = a.solve();
+    config.wordFit = false;
+    auto rb = rows;
+    auto cb = cols;
+    Solver b(config, std::move(rb), std::move(cb));
+    bool solvedB = b.solve();
+    config.wordFit = true;
+    wordMismatches += solvedA != solvedB ||
+                      a.stats_.lineCount != b.stats_.lineCount ||
+                      a.stats_.wrongGuesses != b.stats_.wrongGuesses;
+  }
+  std::cout << wordMismatches << " word fit mismatches" << std::endl;  // 0
+
+  // long lines scan through their summary, which follows every cell
+  // set and cleared.
+  const int length = 1000;
+  int mismatches = 0;
+  for (bool row : {true, false}) {
+    std::vector<std::vector<int>> one(1), many(length);
+    Solver l(config, row ? std::move(one) : std::move(many),
+             row ? std::move(many) : std::move(one));
+    LineName name = row ? LineName::Row(0) : LineName::Column(0);
+    for (int round = 0; round < 40; round++) {
+      // runs of random lengths, some of them far longer than a word.
+      int i = 0;
+      while (i < length) {
+        int run = 1 + rng() % (round % 2 == 0 ? 8 : 400);
+        int val = rng() % 3;
+        for (int k = i; k < i + run && k < length; k++) {
+          int x = row ? k : 0;
+          int y = row ? 0 : k;
+          if (l.g_.get(x, y) != CellState::EMPTY) {
+            l.g_.clear(x, y);
+          }
+          if (val != 0) {
+            l.g_.set(x, y, val == 1 ? CellState::SOLID : CellState::CROSSED);
+          }
+        }
+        i += run;
+      }
+      Slice slice(l, name);
+      mismatches +=
+          scanMismatches(slice, rng) + scanMismatches(slice.reverse(), rng);
+    }
+  }
+  std::cout << mismatches << " scan mismatches" << std::endl;  // 0
+
+  // bounds are uint16_t, so the longest line is maxLineLength cells.
+  std::vector<std::vector<int>> widest(maxLineLength, std::vector<int>{1});
+  std::vector<std::vector<int>> full = {{maxLineLength}};
+  bool fits = Solver::validPuzzle(full, widest);
+  int maxLines = config.maxLines;
+  config.maxLines = 2 * maxLineLength;  // one per column and the row
+  Solver w(config, std::move(full), std::move(widest));
+  bool solvedWidest = w.solve();
+  config.maxLines = maxLines;
+  std::vector<std::vector<int>> tooWide(maxLineLength + 1);
+  std::cout << fits << ' ' << solvedWidest << ' '
+            << Solver::validPuzzle({{1}}, tooWide) << ' '
+            << Solver::validPuzzle({{maxClue + 1}}, {{1}}) << ' '
+            << Solver::validPuzzle({{-1}}, {{1}}) << std::endl;  // 1 1 0 0 0
+}
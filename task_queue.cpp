@@ -79,3 +79,13 @@ std::optional<std::string> TaskQueue::GetResult() {
   auto fut = t.get()->get_future();
   return fut.get();
 }
+
+bool ThreadBudget::TryAcquire() {
+  int n = available_.load();
+  while (n > 0) {
+    if (available_.compare_exchange_weak(n, n - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
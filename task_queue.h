@@ -1,6 +1,7 @@
 #ifndef _TASK_QUEUE_H_
 #define _TASK_QUEUE_H_
 
+#include <atomic>
 #include <deque>
 #include <future>
 #include <mutex>
@@ -45,4 +46,23 @@ class TaskQueue {
   std::optional<std::string> GetResult();
 };
 
+// ThreadBudget is a count of threads that may run at once, shared by
+// everything that starts threads in a process so that together they do
+// not oversubscribe the cores.
+//
+// Long-running workers (like TaskQueue's) call Acquire while they are
+// busy, which may take the count below zero; optional helpers only
+// start when TryAcquire succeeds. Every acquisition is paired with a
+// Release.
+class ThreadBudget {
+  std::atomic<int> available_;
+
+ public:
+  explicit ThreadBudget(int num_threads) : available_(num_threads){};
+
+  void Acquire() { available_--; };
+  bool TryAcquire();
+  void Release() { available_++; };
+};
+
 #endif  // _TASK_QUEUE_H_